@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ * Android BPF library - kernel interface of the loader
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/bpf.h>
+#include <sys/types.h>
+
+#include <string>
+
+namespace android {
+namespace bpf {
+
+/*
+ * Everything the loader asks of the kernel: the bpf() syscall, plus the filesystem operations
+ * it performs on pinned objects in bpffs and the duplication of the fds it was handed, and of
+ * the device: the properties which size its maps.  The running kernel is used unless a
+ * replacement (ie. FakeBpfBackend, on hosts without bpf support) is installed with
+ * setBpfBackend().
+ *
+ * All methods but getProperty() follow the semantics of the syscall of the same name: they
+ * return -1 and set errno on failure.  Implementations must be thread safe, objects are loaded
+ * concurrently.
+ */
+class BpfBackend {
+  public:
+    virtual ~BpfBackend() = default;
+
+    virtual int bpf(enum bpf_cmd cmd, const union bpf_attr& attr) = 0;
+    virtual int access(const char* path, int mode) = 0;
+    virtual int chmod(const char* path, mode_t mode) = 0;
+    virtual int chown(const char* path, uid_t uid, gid_t gid) = 0;
+    virtual int unlink(const char* path) = 0;
+    virtual int rename(const char* from, const char* to) = 0;
+    // As fcntl(fd, F_DUPFD_CLOEXEC, 0)
+    virtual int dup(int fd) = 0;
+
+    // In KVER() format, 0 if unknown
+    virtual unsigned kernelVersion() = 0;
+    // The value of a system property, "" if it isn't set
+    virtual std::string getProperty(const std::string& name) = 0;
+};
+
+BpfBackend& getBpfBackend();
+
+// Passing nullptr restores the running kernel. Must not be called while objects are loading.
+void setBpfBackend(BpfBackend* backend);
+
+}  // namespace bpf
+}  // namespace android
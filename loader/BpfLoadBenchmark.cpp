@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Loader microbenchmarks over synthetic objects of increasing size, one benchmark per phase of
+ * loadProg() plus loadProg() itself against FakeBpfBackend.  Every benchmark runs over the same
+ * object sizes and is named <phase>/maps:<n>/progs:<n>/relos:<n>/labels:<n>, so results from
+ * different builds line up; use --benchmark_format=json (or csv) to track regressions.
+ */
+
+#include <fcntl.h>
+#include <linux/bpf.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+
+#include "BpfPack.h"
+#include "FakeBpfBackend.h"
+#include "Loader.h"
+#include "SyntheticElf.h"
+#include "bpf/BpfUtils.h"
+#include "include/libbpf_android.h"
+
+using android::base::unique_fd;
+using std::string;
+using std::vector;
+
+namespace android {
+namespace bpf {
+
+static void objectSizes(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"maps", "progs", "relos", "labels"})
+            ->Args({8, 4, 16, 4})
+            ->Args({64, 16, 64, 16})
+            ->Args({256, 32, 256, 64})
+            ->Args({512, 64, 512, 256});
+}
+
+static SyntheticElf makeObject(const benchmark::State& state) {
+    return SyntheticElf(state.range(0), state.range(1), state.range(2), state.range(3));
+}
+
+static void BM_mapElfObject(benchmark::State& state) {
+    SyntheticElf synth = makeObject(state);
+    const char* path = synth.write();
+
+    for (auto _ : state) {
+        ElfObject elf;
+        if (mapElfObject(path, elf)) {
+            state.SkipWithError("mapElfObject failed");
+            return;
+        }
+    }
+}
+BENCHMARK(BM_mapElfObject)->Apply(objectSizes);
+
+static void BM_readSectionByName(benchmark::State& state) {
+    SyntheticElf synth = makeObject(state);
+    ElfObject elf;
+    if (mapElfObject(synth.write(), elf)) {
+        state.SkipWithError("mapElfObject failed");
+        return;
+    }
+
+    vector<string> names = synth.codeSections();
+    names.insert(names.end(), {"license", "maps", "progs", "critical", "bpfloader_min_ver"});
+
+    for (auto _ : state) {
+        for (const auto& name : names) {
+            sectionView data;
+            benchmark::DoNotOptimize(readSectionByName(name.c_str(), elf, data));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * names.size());
+}
+BENCHMARK(BM_readSectionByName)->Apply(objectSizes);
+
+// What loading an object asks for: map and program definition names, and each program's name
+static void BM_getSectionSymNames(benchmark::State& state) {
+    SyntheticElf synth = makeObject(state);
+    ElfObject elf;
+    if (mapElfObject(synth.write(), elf)) {
+        state.SkipWithError("mapElfObject failed");
+        return;
+    }
+
+    for (auto _ : state) {
+        vector<string> names;
+        getSectionSymNames(elf, "maps", names);
+        getSectionSymNames(elf, "progs", names);
+        for (const auto& section : synth.codeSections()) {
+            getSectionSymNames(elf, section, names, STT_FUNC);
+        }
+        benchmark::DoNotOptimize(names.data());
+    }
+    state.SetItemsProcessed(state.iterations() * (2 + synth.codeSections().size()));
+}
+BENCHMARK(BM_getSectionSymNames)->Apply(objectSizes);
+
+static void BM_readCodeSections(benchmark::State& state) {
+    SyntheticElf synth = makeObject(state);
+    ElfObject elf;
+    if (mapElfObject(synth.write(), elf)) {
+        state.SkipWithError("mapElfObject failed");
+        return;
+    }
+
+    for (auto _ : state) {
+        vector<codeSection> cs;
+        if (readCodeSections(elf, cs, nullptr, 0)) {
+            state.SkipWithError("readCodeSections failed");
+            return;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+BENCHMARK(BM_readCodeSections)->Apply(objectSizes);
+
+static void BM_resolveMapRelos(benchmark::State& state) {
+    SyntheticElf synth = makeObject(state);
+    ElfObject elf;
+    if (mapElfObject(synth.write(), elf)) {
+        state.SkipWithError("mapElfObject failed");
+        return;
+    }
+
+    vector<codeSection> cs;
+    if (readCodeSections(elf, cs, nullptr, 0)) {
+        state.SkipWithError("readCodeSections failed");
+        return;
+    }
+
+    for (auto _ : state) {
+        for (auto& c : cs) c.relos.clear();
+        resolveMapRelos(elf, cs);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1) * state.range(2));
+}
+BENCHMARK(BM_resolveMapRelos)->Apply(objectSizes);
+
+static void BM_applyMapRelo(benchmark::State& state) {
+    SyntheticElf synth = makeObject(state);
+    ElfObject elf;
+    if (mapElfObject(synth.write(), elf)) {
+        state.SkipWithError("mapElfObject failed");
+        return;
+    }
+
+    vector<codeSection> cs;
+    if (readCodeSections(elf, cs, nullptr, 0)) {
+        state.SkipWithError("readCodeSections failed");
+        return;
+    }
+    resolveMapRelos(elf, cs);
+
+    // The relocated fds are never used, so every map can share /dev/null.
+    vector<unique_fd> mapFds;
+    for (int i = 0; i < state.range(0); i++) {
+        mapFds.emplace_back(open("/dev/null", O_RDONLY | O_CLOEXEC));
+    }
+
+    for (auto _ : state) applyMapRelo(mapFds, cs);
+
+    state.SetItemsProcessed(state.iterations() * state.range(1) * state.range(2));
+}
+BENCHMARK(BM_applyMapRelo)->Apply(objectSizes);
+
+// The bpfpack replacement for all of the above but applyMapRelo
+static void BM_readBpfPack(benchmark::State& state) {
+    SyntheticElf synth = makeObject(state);
+    const char* path = synth.write();
+    string packPath = string(path) + BPF_PACK_SUFFIX;
+
+    if (writeBpfPack(path, packPath.c_str())) {
+        state.SkipWithError("writeBpfPack failed");
+        return;
+    }
+
+    for (auto _ : state) {
+        PackObject pack;
+        objectContents contents;
+        if (readBpfPack(path, pack, contents, nullptr, 0)) {
+            state.SkipWithError("readBpfPack failed");
+            break;
+        }
+    }
+    unlink(packPath.c_str());
+}
+BENCHMARK(BM_readBpfPack)->Apply(objectSizes);
+
+// Everything but the kernel: a fresh fake kernel per iteration, so nothing is reused
+static void BM_loadProg(benchmark::State& state) {
+    SyntheticElf synth = makeObject(state);
+    const char* path = synth.write();
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto kernel = std::make_unique<FakeBpfBackend>(KVER(6, 1, 0));
+        setBpfBackend(kernel.get());
+        state.ResumeTiming();
+
+        bool critical;
+        if (loadProg(path, &critical)) {
+            setBpfBackend(nullptr);
+            state.SkipWithError("loadProg failed");
+            return;
+        }
+    }
+    setBpfBackend(nullptr);
+}
+BENCHMARK(BM_loadProg)->Apply(objectSizes)->UseRealTime();
+
+// A second load of the same object, which reuses all pinned maps and programs
+static void BM_loadProgReuse(benchmark::State& state) {
+    SyntheticElf synth = makeObject(state);
+    const char* path = synth.write();
+    FakeBpfBackend kernel(KVER(6, 1, 0));
+    bool critical;
+
+    setBpfBackend(&kernel);
+    if (loadProg(path, &critical)) {
+        state.SkipWithError("loadProg failed");
+    } else {
+        for (auto _ : state) loadProg(path, &critical);
+    }
+    setBpfBackend(nullptr);
+}
+BENCHMARK(BM_loadProgReuse)->Apply(objectSizes)->UseRealTime();
+
+}  // namespace bpf
+}  // namespace android
+
+BENCHMARK_MAIN();
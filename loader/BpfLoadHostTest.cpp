@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <gtest/gtest.h>
+
+#include "BpfPack.h"
+#include "BpfSyscallWrappers.h"
+#include "FakeBpfBackend.h"
+#include "Loader.h"
+#include "SyntheticElf.h"
+#include "bpf/BpfUtils.h"
+#include "include/libbpf_android.h"
+
+using android::base::StartsWith;
+
+namespace android {
+namespace bpf {
+
+// Runs the whole loader against FakeBpfBackend, so needs neither root nor a bpf capable kernel
+class BpfLoadHostTest : public ::testing::Test {
+  protected:
+    BpfLoadHostTest() : mKernel(KVER(6, 1, 0)) {}
+
+    void SetUp() { setBpfBackend(&mKernel); }
+    void TearDown() {
+        setBpfBackend(nullptr);
+        setMemoryBudget(0);
+    }
+
+    FakeBpfBackend mKernel;
+};
+
+TEST_F(BpfLoadHostTest, loadsAndPinsMapsAndPrograms) {
+    SyntheticElf synth(4, 3, 8);
+    bool critical = true;
+
+    ASSERT_EQ(loadProg(synth.write(), &critical), 0);
+    EXPECT_FALSE(critical);
+    EXPECT_EQ(mKernel.mapCreates(), 4);
+    EXPECT_EQ(mKernel.progLoads(), 3);
+
+    int maps = 0, progs = 0;
+    for (const auto& [path, pin] : mKernel.pins()) {
+        if (pin.obj->isMap) {
+            EXPECT_TRUE(StartsWith(path, "/sys/fs/bpf/map_")) << path;
+            EXPECT_EQ(pin.mode, 0600u) << path;
+            maps++;
+        } else {
+            EXPECT_TRUE(StartsWith(path, "/sys/fs/bpf/prog_")) << path;
+            EXPECT_EQ(pin.mode, 0440u) << path;
+            progs++;
+
+            // Every relocation was resolved to a map fd (the fake rejects unknown fds)
+            int mapRefs = 0;
+            for (const auto& insn : pin.obj->insns) {
+                if (insn.code == (BPF_LD | BPF_IMM | BPF_DW) && insn.src_reg == BPF_PSEUDO_MAP_FD) {
+                    mapRefs++;
+                }
+            }
+            EXPECT_EQ(mapRefs, 8) << path;
+        }
+    }
+    EXPECT_EQ(maps, 4);
+    EXPECT_EQ(progs, 3);
+}
+
+TEST_F(BpfLoadHostTest, reloadReusesPinnedObjects) {
+    SyntheticElf synth(2, 2, 4);
+    const char* path = synth.write();
+    bool critical;
+
+    ASSERT_EQ(loadProg(path, &critical), 0);
+    ASSERT_EQ(loadProg(path, &critical), 0);
+    EXPECT_EQ(mKernel.mapCreates(), 2);
+    EXPECT_EQ(mKernel.progLoads(), 2);
+    EXPECT_EQ(mKernel.pins().size(), 4u);
+}
+
+TEST_F(BpfLoadHostTest, reloadReplacesChangedPrograms) {
+    SyntheticElf synth(2, 1, 2);
+    SyntheticElf updated(2, 1, 4);
+    const char* path = synth.write();
+    std::string contents;
+    bool critical;
+
+    ASSERT_EQ(loadProg(path, &critical), 0);
+    ASSERT_TRUE(android::base::ReadFileToString(updated.write(), &contents));
+    ASSERT_TRUE(android::base::WriteStringToFile(contents, path));
+    ASSERT_EQ(loadProg(path, &critical), 0);
+
+    // Same maps, a new program pinned in place of the old one
+    EXPECT_EQ(mKernel.mapCreates(), 2);
+    EXPECT_EQ(mKernel.progLoads(), 2);
+    auto pins = mKernel.pins();
+    ASSERT_EQ(pins.size(), 3u);
+    for (const auto& [pinPath, pin] : pins) {
+        if (!pin.obj->isMap) EXPECT_EQ(pin.obj->insns.size(), 10u) << pinPath;
+    }
+}
+
+TEST_F(BpfLoadHostTest, criticalFailureCancelsLaterLocations) {
+    SyntheticElf failing(1, 1, 1), sameLocation(1, 1, 1), later(1, 1, 1);
+    failing.addUintSection("critical", 0);
+    failing.setProgVariant(0, "p", "a", 0, 0xFFFFFFFF);
+    Location first, second = {.prefix = "second/"};
+    std::vector<LoadTarget> targets = {
+            {failing.write(), &first}, {sameLocation.write(), &first}, {later.write(), &second}};
+
+    mKernel.failProgLoad("tracepoint_p$a", EACCES);
+    auto results = loadProgs(targets, 1);
+    EXPECT_TRUE(results[0].isCritical);
+    EXPECT_NE(results[0].ret, 0);
+    EXPECT_EQ(results[1].ret, 0);
+    EXPECT_EQ(results[2].ret, -ECANCELED);
+}
+
+TEST_F(BpfLoadHostTest, incrementalLoadOnlyLoadsChanges) {
+    TemporaryDir dir;
+    std::string manifest = std::string(dir.path) + "/manifest";
+    SyntheticElf kept(1, 1, 1), changed(1, 1, 1), removed(1, 1, 1), updated(1, 1, 2);
+    Location location;
+    std::vector<LoadTarget> targets = {
+            {kept.write(), &location}, {changed.write(), &location}, {removed.write(), &location}};
+
+    auto results = loadProgsIncremental(targets, 2, manifest);
+    for (const auto& result : results) {
+        ASSERT_EQ(result.ret, 0);
+        EXPECT_EQ(result.pinPaths.size(), 2u);
+    }
+    EXPECT_EQ(mKernel.pins().size(), 6u);
+
+    std::string contents;
+    ASSERT_TRUE(android::base::ReadFileToString(updated.write(), &contents));
+    ASSERT_TRUE(android::base::WriteStringToFile(contents, targets[1].elfPath));
+    targets.pop_back();
+    int progLoads = mKernel.progLoads();
+
+    results = loadProgsIncremental(targets, 2, manifest);
+    ASSERT_EQ(results[0].ret, 0);
+    ASSERT_EQ(results[1].ret, 0);
+    EXPECT_EQ(results[0].timings.totalUs, 0);  // skipped
+    EXPECT_EQ(mKernel.progLoads(), progLoads + 1);
+
+    auto pins = mKernel.pins();
+    EXPECT_EQ(pins.size(), 4u);
+    for (const auto& pinPath : results[0].pinPaths) EXPECT_EQ(pins.count(pinPath), 1u);
+    for (const auto& pinPath : results[1].pinPaths) EXPECT_EQ(pins.count(pinPath), 1u);
+}
+
+TEST_F(BpfLoadHostTest, incrementalLoadReloadsUsersOfMigratedMaps) {
+    TemporaryDir dir;
+    std::string manifest = std::string(dir.path) + "/manifest";
+    SyntheticElf kept(1, 1, 1), changed(1, 1, 1), updated(1, 1, 2);
+    for (SyntheticElf* synth : {&kept, &changed, &updated}) synth->setMapShared(0);
+    Location location = {.prefix = "resized/"};
+    std::vector<LoadTarget> targets = {{kept.write(), &location}, {changed.write(), &location}};
+
+    auto results = loadProgsIncremental(targets, 2, manifest);
+    ASSERT_EQ(results[0].ret, 0);
+    ASSERT_EQ(results[1].ret, 0);
+
+    // The shared map is resized for everyone, but only one of its users is updated
+    mKernel.setProperty("ro.bpfloader.max_entries.resized.map__map_0", "64");
+    std::string contents;
+    ASSERT_TRUE(android::base::ReadFileToString(updated.write(), &contents));
+    ASSERT_TRUE(android::base::WriteStringToFile(contents, targets[1].elfPath));
+    setMapMigration(true);
+    results = loadProgsIncremental(targets, 2, manifest);
+    setMapMigration(false);
+    ASSERT_EQ(results[0].ret, 0);
+    ASSERT_EQ(results[1].ret, 0);
+    EXPECT_NE(results[0].timings.totalUs, 0);  // unchanged, but loaded again
+
+    // Every program uses the map which is pinned now
+    auto pins = mKernel.pins();
+    std::vector<__u32> mapIds;
+    for (const auto& [pinPath, pin] : pins) {
+        if (pin.obj->isMap) mapIds.push_back(pin.obj->mapInfo.id);
+        if (pin.obj->isMap) EXPECT_EQ(pin.obj->mapInfo.max_entries, 64u);
+    }
+    ASSERT_EQ(mapIds.size(), 1u);
+    for (const auto& [pinPath, pin] : pins) {
+        if (!pin.obj->isMap) EXPECT_EQ(pin.obj->mapIds, mapIds) << pinPath;
+    }
+}
+
+TEST_F(BpfLoadHostTest, migratesMapOnDefinitionChange) {
+    SyntheticElf synth(1, 1, 1);
+    SyntheticElf grown(1, 1, 1, 0, false, 64);
+    const char* path = synth.write();
+    std::string contents;
+    bool critical;
+
+    ASSERT_EQ(loadProg(path, &critical), 0);
+    std::string mapPath, progPath;
+    for (const auto& [pinPath, pin] : mKernel.pins()) {
+        (pin.obj->isMap ? mapPath : progPath) = pinPath;
+    }
+
+    union bpf_attr get = {.pathname = ptr_to_u64(mapPath.c_str())};
+    int mapFd = mKernel.bpf(BPF_OBJ_GET, get);
+    ASSERT_GE(mapFd, 0);
+    for (uint32_t key = 0; key < 3; key++) {
+        uint32_t value = key * 10;
+        union bpf_attr update = {
+            .map_fd = static_cast<__u32>(mapFd),
+            .key = ptr_to_u64(&key),
+            .value = ptr_to_u64(&value),
+        };
+        ASSERT_EQ(mKernel.bpf(BPF_MAP_UPDATE_ELEM, update), 0);
+    }
+    close(mapFd);
+
+    ASSERT_TRUE(android::base::ReadFileToString(grown.write(), &contents));
+    ASSERT_TRUE(android::base::WriteStringToFile(contents, path));
+    EXPECT_EQ(loadProg(path, &critical), -ENOTUNIQ);
+
+    // A batch too small for a hash bucket is retried bigger
+    setMapMigration(true);
+    mKernel.failNext(BPF_MAP_LOOKUP_BATCH, ENOSPC);
+    EXPECT_EQ(loadProg(path, &critical), 0);
+    setMapMigration(false);
+
+    auto pins = mKernel.pins();
+    ASSERT_EQ(pins.size(), 2u);
+    const auto& map = *pins[mapPath].obj;
+    EXPECT_EQ(map.mapInfo.max_entries, 64u);
+    EXPECT_EQ(map.entries.size(), 3u);
+    EXPECT_EQ(mKernel.calls(BPF_MAP_GET_NEXT_KEY), 0);
+
+    // The program was loaded again, against the new map
+    EXPECT_EQ(mKernel.progLoads(), 2);
+    EXPECT_EQ(pins[progPath].obj->mapIds, std::vector<__u32>{map.mapInfo.id});
+}
+
+TEST_F(BpfLoadHostTest, failedCopyFailsMapMigration) {
+    SyntheticElf synth(1, 1, 1);
+    SyntheticElf grown(1, 1, 1, 0, false, 64);
+    const char* path = synth.write();
+    std::string contents;
+    bool critical;
+
+    ASSERT_EQ(loadProg(path, &critical), 0);
+    ASSERT_TRUE(android::base::ReadFileToString(grown.write(), &contents));
+    ASSERT_TRUE(android::base::WriteStringToFile(contents, path));
+
+    // Only a kernel without batch operations falls back to copying entry by entry
+    setMapMigration(true);
+    mKernel.failNext(BPF_MAP_LOOKUP_BATCH, EFAULT);
+    EXPECT_EQ(loadProg(path, &critical), -EFAULT);
+    setMapMigration(false);
+
+    EXPECT_EQ(mKernel.calls(BPF_MAP_GET_NEXT_KEY), 0);
+    for (const auto& [pinPath, pin] : mKernel.pins()) {
+        if (pin.obj->isMap) EXPECT_EQ(pin.obj->mapInfo.max_entries, 16u) << pinPath;
+    }
+}
+
+TEST_F(BpfLoadHostTest, failedProgramFailsObject) {
+    SyntheticElf synth(1, 1, 1);
+    bool critical;
+
+    mKernel.failProgLoad("tracepoint_prog", EACCES);
+    EXPECT_NE(loadProg(synth.write(), &critical), 0);
+
+    // The map was pinned before the program failed, the program wasn't
+    auto pins = mKernel.pins();
+    ASSERT_EQ(pins.size(), 1u);
+    EXPECT_TRUE(pins.begin()->second.obj->isMap);
+}
+
+TEST_F(BpfLoadHostTest, scalesMaps) {
+    SyntheticElf synth(3, 1, 3);
+    synth.addMapScaling({{"map_0", 1u << 20, 0, 1000}, {"map_1", 0, 0, 4}});
+    bool critical;
+
+    ASSERT_EQ(loadProg(synth.write(), &critical), 0);
+    std::map<std::string, unsigned> maxEntries;
+    for (const auto& [path, pin] : mKernel.pins()) {
+        if (pin.obj->isMap) maxEntries[pin.obj->mapInfo.name] = pin.obj->mapInfo.max_entries;
+    }
+    EXPECT_EQ(maxEntries["map_0"], 1000u);  // capped
+    EXPECT_EQ(maxEntries["map_1"], 16u);    // never below the definition
+    EXPECT_EQ(maxEntries["map_2"], 16u);
+}
+
+TEST_F(BpfLoadHostTest, reportsAndBudgetsMemory) {
+    SyntheticElf synth(2, 1, 2), other(2, 1, 2);
+    Location location;
+
+    auto results = loadProgs({synth.write()}, location, 1);
+    ASSERT_EQ(results[0].ret, 0);
+    // Preallocated 16 entry hash maps: 16 buckets, 16 elements of header, key and value
+    const LoadFootprint& footprint = results[0].footprint;
+    EXPECT_EQ(footprint.mapBytes, 2 * (16 * 16 + 16 * (48 + 8 + 8)));
+    EXPECT_EQ(footprint.maps.size(), 2u);
+    EXPECT_EQ(footprint.progXlatedBytes, 6 * 8);
+    EXPECT_EQ(footprint.progs.size(), 1u);
+
+    // Reused maps and programs are free, the second map of another object isn't
+    setMemoryBudget(footprint.mapBytes * 3 / 4);
+    EXPECT_EQ(loadProgs({synth.write()}, location, 1)[0].footprint.mapBytes, 0);
+    results = loadProgs({other.write()}, location, 1);
+    EXPECT_EQ(results[0].ret, -ENOMEM);
+    EXPECT_EQ(results[0].footprint.maps.size(), 1u);
+}
+
+TEST_F(BpfLoadHostTest, failedMapsDontUseTheBudget) {
+    SyntheticElf failing(2, 1, 2), other(1, 1, 1);
+    Location location;
+
+    // Room for two maps: one of failing, which fails to create its second, and one of other,
+    // plus other's program
+    setMemoryBudget(2 * (16 * 16 + 16 * (48 + 8 + 8)) + 4 * 8);
+    mKernel.failMapCreate("map_1", EPERM);
+    EXPECT_EQ(loadProgs({failing.write()}, location, 1)[0].ret, -EPERM);
+    EXPECT_EQ(loadProgs({other.write()}, location, 1)[0].ret, 0);
+}
+
+TEST_F(BpfLoadHostTest, budgetsProgramsBeforeVerifyingThem) {
+    SyntheticElf synth(1, 1, 2), updated(1, 1, 4), other(1, 1, 1);
+    const char* path = synth.write();
+    std::string contents;
+    bool critical;
+
+    // Room for the map and the updated program: the one it replaces is freed
+    setMemoryBudget(16 * 16 + 16 * (48 + 8 + 8) + 10 * 8);
+    ASSERT_EQ(loadProg(path, &critical), 0);
+    ASSERT_TRUE(android::base::ReadFileToString(updated.write(), &contents));
+    ASSERT_TRUE(android::base::WriteStringToFile(contents, path));
+    EXPECT_EQ(loadProg(path, &critical), 0);
+
+    // Room for the map only, the program isn't even verified
+    setMemoryBudget(16 * 16 + 16 * (48 + 8 + 8));
+    int progLoads = mKernel.progLoads();
+    EXPECT_EQ(loadProg(other.write(), &critical), -ENOMEM);
+    EXPECT_EQ(mKernel.progLoads(), progLoads);
+}
+
+TEST_F(BpfLoadHostTest, reportsVerifierStats) {
+    SyntheticElf synth(1, 2, 2);
+    Location location;
+
+    auto results = loadProgs({synth.write()}, location, 1);
+    ASSERT_EQ(results[0].ret, 0);
+    ASSERT_EQ(results[0].verifierStats.size(), 2u);
+    for (const auto& stats : results[0].verifierStats) {
+        EXPECT_TRUE(StartsWith(stats.prog, "tracepoint_prog_")) << stats.prog;
+        EXPECT_EQ(stats.insnsProcessed, 6);
+        EXPECT_EQ(stats.peakStates, 3);
+    }
+}
+
+TEST_F(BpfLoadHostTest, prunesProgramsBeforeReadingThem) {
+    SyntheticElf synth(1, 4, 1);
+    synth.setProgVariant(0, "prog", "4_19", KVER(4, 19, 0), KVER(5, 10, 0));
+    synth.setProgVariant(1, "prog", "5_10", KVER(5, 10, 0), KVER(6, 6, 0));
+    synth.setProgVariant(2, "prog", "6_6", KVER(6, 6, 0), 0xFFFFFFFF);
+    synth.setProgVariant(3, "other", "old", 0, KVER(5, 4, 0));
+    const char* path = synth.write();
+
+    ElfObject elf;
+    std::vector<codeSection> cs;
+    loadEnv env = {.kvers = KVER(6, 1, 0), .buildType = "user"};
+    ASSERT_EQ(mapElfObject(path, elf), 0);
+    ASSERT_EQ(readCodeSections(elf, cs, nullptr, 0, &env), 0);
+    ASSERT_EQ(cs.size(), 1u);
+    EXPECT_EQ(cs[0].name, "tracepoint_prog$5_10");
+
+    bool critical;
+    ASSERT_EQ(loadProg(path, &critical), 0);
+    EXPECT_EQ(mKernel.progLoads(), 1);
+}
+
+TEST_F(BpfLoadHostTest, firstOfOverlappingVariantsApplies) {
+    SyntheticElf synth(1, 2, 1);
+    synth.setProgVariant(0, "prog", "a", KVER(4, 19, 0), 0xFFFFFFFF);
+    synth.setProgVariant(1, "prog", "b", KVER(5, 10, 0), 0xFFFFFFFF);
+    const char* path = synth.write();
+
+    ElfObject elf;
+    std::vector<codeSection> cs;
+    loadEnv env = {.kvers = KVER(6, 1, 0), .buildType = "user"};
+    ASSERT_EQ(mapElfObject(path, elf), 0);
+    ASSERT_EQ(readCodeSections(elf, cs, nullptr, 0, &env), 0);
+    ASSERT_EQ(cs.size(), 1u);
+    EXPECT_EQ(cs[0].name, "tracepoint_prog$a");
+}
+
+TEST_F(BpfLoadHostTest, failedOptionalVariantFallsBackToTheNext) {
+    SyntheticElf synth(1, 2, 1, 0, true);
+    synth.setProgVariant(0, "p", "a", KVER(4, 19, 0), 0xFFFFFFFF);
+    synth.setProgVariant(1, "p", "b", KVER(5, 10, 0), 0xFFFFFFFF);
+    bool critical;
+
+    mKernel.failProgLoad("tracepoint_p$a", EINVAL);
+    ASSERT_EQ(loadProg(synth.write(), &critical), 0);
+
+    auto pins = mKernel.pins();
+    ASSERT_EQ(pins.size(), 2u);
+    for (const auto& [path, pin] : pins) {
+        if (!pin.obj->isMap) EXPECT_STREQ(pin.obj->progInfo.name, "tracepoint_p$b") << path;
+    }
+}
+
+TEST_F(BpfLoadHostTest, loadsOnlyTheApplicableObjectVersion) {
+    TemporaryDir dir;
+    SyntheticElf old(1, 1, 1), current(1, 1, 1), future(1, 1, 1);
+    old.addUintSection("bpfloader_max_ver", BPFLOADER_VERSION);
+    current.addUintSection("bpfloader_min_ver", BPFLOADER_VERSION);
+    future.addUintSection("bpfloader_min_ver", BPFLOADER_VERSION + 1);
+
+    Location location;
+    std::vector<std::string> paths;
+    for (SyntheticElf* synth : {&old, &current, &future}) {
+        std::string contents;
+        paths.push_back(std::string(dir.path) + "/foo@" + std::to_string(paths.size()) + ".o");
+        ASSERT_TRUE(android::base::ReadFileToString(synth->write(), &contents));
+        ASSERT_TRUE(android::base::WriteStringToFile(contents, paths.back()));
+    }
+    // A single version is checked too
+    std::string contents;
+    paths.push_back(std::string(dir.path) + "/bar@1.o");
+    ASSERT_TRUE(android::base::ReadFileToString(future.write(), &contents));
+    ASSERT_TRUE(android::base::WriteStringToFile(contents, paths.back()));
+
+    auto results = loadProgs(paths, location, 2);
+    for (const auto& result : results) EXPECT_EQ(result.ret, 0);
+    EXPECT_EQ(results[1].pinPaths.size(), 2u);
+    // The others weren't even parsed
+    EXPECT_EQ(results[0].timings.totalUs, 0);
+    EXPECT_EQ(results[2].timings.totalUs, 0);
+    EXPECT_EQ(results[3].timings.totalUs, 0);
+    EXPECT_EQ(mKernel.progLoads(), 1);
+}
+
+TEST_F(BpfLoadHostTest, loadsIdenticalProgramsOnce) {
+    // Without relocations, the programs of both objects are the same
+    SyntheticElf first(0, 2, 0), second(0, 3, 0);
+    Location location;
+
+    auto results = loadProgs({first.write(), second.write()}, location, 2);
+    ASSERT_EQ(results[0].ret, 0);
+    ASSERT_EQ(results[1].ret, 0);
+    EXPECT_EQ(mKernel.progLoads(), 3);
+
+    std::map<std::string, const FakeBpfBackend::Object*> progs;  // by program name
+    for (const auto& [path, pin] : mKernel.pins()) {
+        std::string name = path.substr(path.rfind("tracepoint_"));
+        if (progs.count(name)) EXPECT_EQ(progs[name], pin.obj.get()) << path;
+        progs[name] = pin.obj.get();
+    }
+    EXPECT_EQ(progs.size(), 3u);
+    EXPECT_EQ(mKernel.pins().size(), 5u);
+    // Only counted where they were loaded
+    EXPECT_EQ(results[0].footprint.progs.size() + results[1].footprint.progs.size(), 3u);
+}
+
+TEST_F(BpfLoadHostTest, reusesRegisteredSharedMaps) {
+    SyntheticElf first(1, 1, 1), second(1, 2, 1);
+    first.setMapShared(0);
+    second.setMapShared(0);
+    Location location;
+
+    auto results = loadProgs({first.write(), second.write()}, location, 2);
+    ASSERT_EQ(results[0].ret, 0);
+    ASSERT_EQ(results[1].ret, 0);
+    EXPECT_EQ(mKernel.mapCreates(), 1);
+    // The second object got the map from the first, not from its pin
+    EXPECT_EQ(mKernel.calls(BPF_OBJ_GET), 0);
+}
+
+TEST_F(BpfLoadHostTest, reloadRecreatesRemovedPins) {
+    SyntheticElf synth(2, 2, 4);
+    const char* path = synth.write();
+    bool critical;
+
+    ASSERT_EQ(loadProg(path, &critical), 0);
+    for (const auto& [pinPath, pin] : mKernel.pins()) ASSERT_EQ(mKernel.unlink(pinPath.c_str()), 0);
+    ASSERT_EQ(loadProg(path, &critical), 0);
+    // Nothing of the first load is remembered once its pins are gone
+    EXPECT_EQ(mKernel.mapCreates(), 4);
+    EXPECT_EQ(mKernel.pins().size(), 4u);
+}
+
+TEST_F(BpfLoadHostTest, getsMapInfoOncePerMap) {
+    // The same program, with and without maps to set up
+    SyntheticElf noMaps(0, 1, 0), maps(8, 1, 0);
+    bool critical;
+
+    ASSERT_EQ(loadProg(noMaps.write(), &critical), 0);
+    int progCalls = mKernel.calls(BPF_OBJ_GET_INFO_BY_FD);
+    ASSERT_EQ(loadProg(maps.write(), &critical), 0);
+    EXPECT_EQ(mKernel.calls(BPF_OBJ_GET_INFO_BY_FD) - 2 * progCalls, 8);
+}
+
+TEST_F(BpfLoadHostTest, sharesOnlyProgramsOfTheSameName) {
+    SyntheticElf first(0, 1, 0), renamed(0, 1, 0);
+    renamed.setProgVariant(0, "other", "x", 0, 0xFFFFFFFF);
+    Location location;
+
+    auto results = loadProgs({first.write(), renamed.write()}, location, 2);
+    ASSERT_EQ(results[0].ret, 0);
+    ASSERT_EQ(results[1].ret, 0);
+    EXPECT_EQ(mKernel.progLoads(), 2);
+}
+
+TEST_F(BpfLoadHostTest, packMatchesObject) {
+    SyntheticElf synth(3, 2, 4, 2);
+    synth.addMapScaling({{"map_2", 0, 64, 0}});
+    const char* path = synth.write();
+    std::string packPath = std::string(path) + BPF_PACK_SUFFIX;
+    ASSERT_EQ(writeBpfPack(path, packPath.c_str()), 0);
+
+    ElfObject elf;
+    objectContents fromElf;
+    ASSERT_EQ(mapElfObject(path, elf), 0);
+    ASSERT_EQ(readMapDefs(elf, fromElf.md, fromElf.mapNames), 0);
+    ASSERT_EQ(readMapScaling(elf, fromElf.scaling), 0);
+    ASSERT_EQ(readCodeSections(elf, fromElf.cs, nullptr, 0), 0);
+    resolveMapRelos(elf, fromElf.cs);
+
+    PackObject pack;
+    objectContents fromPack;
+    ASSERT_EQ(readBpfPack(path, pack, fromPack, nullptr, 0), 0);
+
+    bool critical;
+    EXPECT_EQ(loadProg(path, &critical), 0);
+    EXPECT_EQ(mKernel.pins().size(), 5u);
+    unlink(packPath.c_str());
+
+    EXPECT_EQ(fromPack.license, "Apache 2.0");
+    EXPECT_EQ(fromPack.mapNames, fromElf.mapNames);
+    ASSERT_EQ(fromPack.scaling.size(), 1u);
+    EXPECT_STREQ(fromPack.scaling[0].map_name, "map_2");
+    EXPECT_EQ(fromPack.scaling[0].per_gib, 64u);
+    ASSERT_EQ(fromPack.cs.size(), fromElf.cs.size());
+    for (size_t i = 0; i < fromPack.cs.size(); i++) {
+        EXPECT_EQ(fromPack.cs[i].name, fromElf.cs[i].name);
+        EXPECT_EQ(fromPack.cs[i].type, fromElf.cs[i].type);
+        EXPECT_TRUE(fromPack.cs[i].prog_def.has_value());
+        ASSERT_EQ(fromPack.cs[i].data.size(), fromElf.cs[i].data.size());
+        EXPECT_EQ(memcmp(fromPack.cs[i].data.data(), fromElf.cs[i].data.data(),
+                         fromPack.cs[i].data.size()), 0);
+        ASSERT_EQ(fromPack.cs[i].relos.size(), fromElf.cs[i].relos.size());
+        for (size_t r = 0; r < fromPack.cs[i].relos.size(); r++) {
+            EXPECT_EQ(fromPack.cs[i].relos[r].offset, fromElf.cs[i].relos[r].offset);
+            EXPECT_EQ(fromPack.cs[i].relos[r].mapIdx, fromElf.cs[i].relos[r].mapIdx);
+        }
+    }
+}
+
+TEST_F(BpfLoadHostTest, stalePackIsIgnored) {
+    SyntheticElf other(1, 1, 1);
+    SyntheticElf synth(3, 2, 4);
+    const char* path = synth.write();
+    std::string packPath = std::string(path) + BPF_PACK_SUFFIX;
+    ASSERT_EQ(writeBpfPack(other.write(), packPath.c_str()), 0);
+
+    PackObject pack;
+    objectContents contents;
+    EXPECT_EQ(readBpfPack(path, pack, contents, nullptr, 0), -ESTALE);
+
+    // Nor is a pack made from an object of the same size
+    SyntheticElf resized(3, 2, 4, 0, false, 32);
+    ASSERT_EQ(writeBpfPack(resized.write(), packPath.c_str()), 0);
+    EXPECT_EQ(readBpfPack(path, pack, contents, nullptr, 0), -ESTALE);
+
+    bool critical;
+    EXPECT_EQ(loadProg(path, &critical), 0);
+    unlink(packPath.c_str());
+    EXPECT_EQ(mKernel.mapCreates(), 3);
+    EXPECT_EQ(mKernel.progLoads(), 2);
+}
+
+TEST_F(BpfLoadHostTest, failedOptionalProgramIsCached) {
+    TemporaryDir dir;
+    std::string cachePath = std::string(dir.path) + "/load_failures";
+    SyntheticElf synth(1, 1, 1, 0, true);
+    const char* path = synth.write();
+    bool critical;
+
+    setLoadFailureCache(cachePath);
+    mKernel.failProgLoad("tracepoint_prog", EACCES);
+    ASSERT_EQ(loadProg(path, &critical), 0);
+    int progLoads = mKernel.progLoads();
+
+    // Also from the file, as on the next boot: the failed program isn't verified again
+    setLoadFailureCache(cachePath);
+    EXPECT_EQ(loadProg(path, &critical), 0);
+    EXPECT_EQ(mKernel.progLoads(), progLoads);
+
+    std::string contents;
+    ASSERT_TRUE(android::base::ReadFileToString(cachePath, &contents));
+    EXPECT_NE(contents.find(" tracepoint_prog_0\n"), std::string::npos) << contents;
+    setLoadFailureCache("");
+}
+
+}  // namespace bpf
+}  // namespace android
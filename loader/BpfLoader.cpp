@@ -36,8 +36,10 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/macros.h>
+#include <android-base/properties.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
@@ -46,7 +48,25 @@
 #include "BpfSyscallWrappers.h"
 #include "bpf/BpfUtils.h"
 
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Per object and per location load timings and kernel memory, in a stable machine readable format
+#define BPF_LOAD_TIMINGS_PATH "/dev/bpfloader_timings"
+
+// What the last 'bpfloader --incremental' run loaded, so that the next one only loads what
+// changed since (the first one loads everything). Pins don't survive a reboot, and neither
+// does this.
+#define BPF_LOAD_MANIFEST_PATH "/dev/bpfloader_manifest"
+
+// Optional programs which failed to load, kept across boots. Only used if the device provides
+// the (early mounted, writable) directory.
+#define BPF_LOAD_FAILURE_CACHE_DIR "/metadata/bpf"
+#define BPF_LOAD_FAILURE_CACHE_PATH BPF_LOAD_FAILURE_CACHE_DIR "/load_failures"
+
 using android::base::EndsWith;
+using android::base::StringPrintf;
 using std::string;
 
 // Networking-related program types are limited to the Tethering Apex
@@ -97,8 +117,15 @@ const android::bpf::Location locations[] = {
         },
 };
 
-int loadAllElfObjects(const android::bpf::Location& location) {
-    int retVal = 0;
+// Number of objects loaded concurrently, 1 restores strictly sequential loading
+static int getLoadWorkers() {
+    unsigned cpus = std::thread::hardware_concurrency();
+    return android::base::GetUintProperty<unsigned>("ro.bpfloader.workers",
+                                                     std::clamp(cpus, 1u, 4u), 64u);
+}
+
+void listElfObjects(const android::bpf::Location& location,
+                    std::vector<android::bpf::LoadTarget>& targets) {
     DIR* dir;
     struct dirent* ent;
 
@@ -109,17 +136,123 @@ int loadAllElfObjects(const android::bpf::Location& location) {
 
             string progPath(location.dir);
             progPath += s;
+            targets.push_back({progPath, &location});
+        }
+        closedir(dir);
+    }
+}
+
+static void addTimings(android::bpf::LoadTimings& sum, const android::bpf::LoadTimings& t) {
+    sum.parseUs += t.parseUs;
+    sum.mapsUs += t.mapsUs;
+    sum.reloUs += t.reloUs;
+    sum.progLoadUs += t.progLoadUs;
+    sum.pinUs += t.pinUs;
+    sum.totalUs += t.totalUs;
+}
 
-            bool critical;
-            int ret = android::bpf::loadProg(progPath.c_str(), &critical, location);
-            if (ret) {
-                if (critical) retVal = ret;
-                ALOGE("Failed to load object: %s, ret: %s", progPath.c_str(), std::strerror(-ret));
-            } else {
-                ALOGV("Loaded object: %s", progPath.c_str());
+static void addFootprint(android::bpf::LoadFootprint& sum,
+                         const android::bpf::LoadFootprint& f) {
+    sum.mapBytes += f.mapBytes;
+    sum.progXlatedBytes += f.progXlatedBytes;
+    sum.progJitedBytes += f.progJitedBytes;
+}
+
+static string formatTimings(const android::bpf::LoadTimings& t) {
+    return StringPrintf("parse=%" PRId64 " maps=%" PRId64 " relo=%" PRId64 " prog_load=%" PRId64
+                        " pin=%" PRId64 " total=%" PRId64,
+                        t.parseUs, t.mapsUs, t.reloUs, t.progLoadUs, t.pinUs, t.totalUs);
+}
+
+static string formatFootprint(const android::bpf::LoadFootprint& f) {
+    return StringPrintf("map_bytes=%" PRId64 " prog_xlated_bytes=%" PRId64
+                        " prog_jited_bytes=%" PRId64,
+                        f.mapBytes, f.progXlatedBytes, f.progJitedBytes);
+}
+
+// Logs a one line summary per location and writes every object's and program's timings,
+// kernel memory and verifier statistics to BPF_LOAD_TIMINGS_PATH, one 'key=value ...' record
+// per line, all times in microseconds and sizes in bytes. Location totals are sums over their
+// objects, which may have been loaded concurrently.
+void reportLoadTimings(const std::vector<android::bpf::LoadTarget>& targets,
+                       const std::vector<android::bpf::LoadResult>& results) {
+    string out = "# bpfloader load timings, in microseconds, and kernel memory, in bytes\n";
+
+    for (const auto& location : locations) {
+        android::bpf::LoadTimings sum;
+        android::bpf::LoadFootprint footprint;
+        android::bpf::VerifierStats slowest;
+        int objects = 0;
+
+        for (size_t i = 0; i < targets.size(); i++) {
+            if (targets[i].location != &location) continue;
+
+            const android::bpf::LoadTimings& t = results[i].timings;
+            const android::bpf::LoadFootprint& f = results[i].footprint;
+            const char* elfPath = targets[i].elfPath.c_str();
+            addTimings(sum, t);
+            addFootprint(footprint, f);
+            objects++;
+
+            out += StringPrintf("object=%s location=%s ret=%d %s %s\n", elfPath, location.dir,
+                                results[i].ret, formatTimings(t).c_str(),
+                                formatFootprint(f).c_str());
+            for (const auto& [name, us] : t.progLoads) {
+                out += StringPrintf("prog=%s:%s load=%" PRId64 "\n", elfPath, name.c_str(), us);
+            }
+            for (const auto& [name, bytes] : f.maps) {
+                out += StringPrintf("map=%s:%s bytes=%" PRId64 "\n", elfPath, name.c_str(),
+                                    bytes);
+            }
+            for (const auto& [name, bytes] : f.progs) {
+                out += StringPrintf("prog=%s:%s bytes=%" PRId64 "\n", elfPath, name.c_str(),
+                                    bytes);
+            }
+            for (const auto& v : results[i].verifierStats) {
+                out += StringPrintf("prog=%s:%s verify=%" PRId64 " insns_processed=%" PRId64
+                                    " total_states=%" PRId64 " peak_states=%" PRId64 "\n",
+                                    elfPath, v.prog.c_str(), v.verificationUs, v.insnsProcessed,
+                                    v.totalStates, v.peakStates);
+                if (v.verificationUs > slowest.verificationUs) {
+                    slowest = v;
+                    slowest.prog = targets[i].elfPath + ":" + v.prog;
+                }
             }
         }
-        closedir(dir);
+
+        string summary = StringPrintf("objects=%d %s %s", objects, formatTimings(sum).c_str(),
+                                      formatFootprint(footprint).c_str());
+        out += StringPrintf("location=%s %s\n", location.dir, summary.c_str());
+        ALOGI("load stats for %s: %s", location.dir, summary.c_str());
+        if (!slowest.prog.empty()) {
+            ALOGI("slowest to verify in %s: %s (%" PRId64 "us, %" PRId64 " insns processed)",
+                  location.dir, slowest.prog.c_str(), slowest.verificationUs,
+                  slowest.insnsProcessed);
+        }
+    }
+
+    if (!android::base::WriteStringToFile(out, BPF_LOAD_TIMINGS_PATH)) {
+        ALOGW("Failed to write %s: %s", BPF_LOAD_TIMINGS_PATH, strerror(errno));
+    }
+}
+
+// Returns the error of the last failed critical object of the given location, if any
+int checkLoadResults(const android::bpf::Location& location,
+                     const std::vector<android::bpf::LoadTarget>& targets,
+                     const std::vector<android::bpf::LoadResult>& results) {
+    int retVal = 0;
+
+    for (size_t i = 0; i < targets.size(); i++) {
+        if (targets[i].location != &location) continue;
+
+        int ret = results[i].ret;
+        if (ret) {
+            if (results[i].isCritical) retVal = ret;
+            ALOGE("Failed to load object: %s, ret: %s", targets[i].elfPath.c_str(),
+                  std::strerror(-ret));
+        } else {
+            ALOGV("Loaded object: %s", targets[i].elfPath.c_str());
+        }
     }
     return retVal;
 }
@@ -144,21 +277,65 @@ int createSysFsBpfSubDir(const char* const prefix) {
     return 0;
 }
 
-int main(int __unused argc, char** argv, char * const envp[]) {
+void criticalFailure(const android::bpf::Location& location) {
+    ALOGE("=== CRITICAL FAILURE LOADING BPF PROGRAMS FROM %s ===", location.dir);
+    ALOGE("If this triggers reliably, you're probably missing kernel options or patches.");
+    ALOGE("If this triggers randomly, you might be hitting some memory allocation "
+          "problems or startup script race.");
+    ALOGE("--- DO NOT EXPECT SYSTEM TO BOOT SUCCESSFULLY ---");
+    sleep(20);
+}
+
+int main(int argc, char** argv, char * const envp[]) {
     android::base::InitLogging(argv, &android::base::KernelLogger);
 
-    // Load all ELF objects, create programs and maps, and pin them
+    // Rerun after an update of some objects (ie. mainline), rather than at boot. Updated objects
+    // may change their maps, which are migrated rather than failing until the next reboot.
+    bool incremental = argc > 1 && !strcmp(argv[1], "--incremental");
+    android::bpf::setMapMigration(incremental);
+
+    // Load all ELF objects, create programs and maps, and pin them. Objects of all locations
+    // are scheduled together, ordered only where they share maps or pin names. As when loading
+    // one location after another, a location whose directory can't be created is a critical
+    // failure once the locations before it are loaded, and the ones after it aren't loaded.
+    std::vector<android::bpf::LoadTarget> targets;
+    const android::bpf::Location* noSubDir = nullptr;
     for (const auto& location : locations) {
-        if (createSysFsBpfSubDir(location.prefix) || loadAllElfObjects(location)) {
-            ALOGE("=== CRITICAL FAILURE LOADING BPF PROGRAMS FROM %s ===", location.dir);
-            ALOGE("If this triggers reliably, you're probably missing kernel options or patches.");
-            ALOGE("If this triggers randomly, you might be hitting some memory allocation "
-                  "problems or startup script race.");
-            ALOGE("--- DO NOT EXPECT SYSTEM TO BOOT SUCCESSFULLY ---");
-            sleep(20);
+        if (createSysFsBpfSubDir(location.prefix)) {
+            noSubDir = &location;
+            break;
+        }
+        listElfObjects(location, targets);
+    }
+
+    // Kernel memory all objects' new maps and programs may take, in KiB, 0 for no limit
+    uint64_t budgetKb = android::base::GetUintProperty<uint64_t>("ro.bpfloader.memory_budget_kb",
+                                                                 0, INT64_MAX / 1024);
+    android::bpf::setMemoryBudget(budgetKb * 1024);
+
+    if (!access(BPF_LOAD_FAILURE_CACHE_DIR, W_OK)) {
+        android::bpf::setLoadFailureCache(BPF_LOAD_FAILURE_CACHE_PATH);
+    }
+
+    // Only reruns consult (and keep) the manifest, the boot time load always loads everything
+    std::vector<android::bpf::LoadResult> results =
+            incremental ? android::bpf::loadProgsIncremental(targets, getLoadWorkers(),
+                                                             BPF_LOAD_MANIFEST_PATH)
+                        : android::bpf::loadProgs(targets, getLoadWorkers());
+    reportLoadTimings(targets, results);
+
+    for (const auto& location : locations) {
+        if (&location == noSubDir) {
+            criticalFailure(location);
+            return 120;
+        }
+        if (checkLoadResults(location, targets, results)) {
+            if (incremental) return 1;
+            criticalFailure(location);
             return 120;
         }
     }
+    if (incremental) return 0;
 
     const char * args[] = { "/apex/com.android.tethering/bin/netbpfload", "done", NULL, };
     execve(args[0], (char**)args, envp);
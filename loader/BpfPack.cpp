@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "BpfLoader"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <log/log.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+
+#include "BpfPack.h"
+
+using android::base::StartsWith;
+using android::base::unique_fd;
+using std::string;
+using std::vector;
+
+namespace android {
+namespace bpf {
+
+uint64_t hashElfObject(const char* data, size_t size) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(data), size, digest);
+    return packedHash(digest);
+}
+
+uint64_t packedHash(const uint8_t (&sha256)[SHA256_DIGEST_LENGTH]) {
+    uint64_t hash;
+    memcpy(&hash, sha256, sizeof(hash));
+    return hash;
+}
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+template <typename T>
+static void append(string& out, const T* p, size_t count) {
+    out.append(reinterpret_cast<const char*>(p), count * sizeof(T));
+    out.resize(align8(out.size()), '\0');
+}
+
+int writeBpfPack(const char* elfPath, const char* packPath) {
+    ElfObject elf;
+    objectContents c;
+    sectionView section;
+    int ret;
+
+    ret = mapElfObject(elfPath, elf);
+    if (ret) return ret;
+
+    // readCodeSections() would silently drop these on a host, see BpfPack.h
+    std::unordered_map<string, string> sectionNames;  // code section name -> ELF section name
+    for (const auto& [name, idx] : elf.sectionIdx) {
+        if (StartsWith(name, "fuse/")) {
+            ALOGE("%s: fuse program section %s, can't be packed", elfPath, name.c_str());
+            return -EINVAL;
+        }
+        string csName = name;
+        std::replace(csName.begin(), csName.end(), '/', '_');
+        if (!sectionNames.emplace(csName, name).second) {
+            ALOGE("%s: ambiguous section name %s", elfPath, name.c_str());
+            return -EINVAL;
+        }
+    }
+
+    c.isCritical = !readSectionByName("critical", elf, section);
+    if (c.isCritical) c.critical = string(section.data(), strnlen(section.data(), section.size()));
+    ret = readSectionByName("license", elf, section);
+    if (ret) return ret;
+    c.license = string(section.data(), strnlen(section.data(), section.size()));
+
+    ret = readMapDefs(elf, c.md, c.mapNames);
+    if (ret && ret != -2) return ret;
+    ret = readMapScaling(elf, c.scaling);
+    if (ret) return ret;
+    ret = readCodeSections(elf, c.cs, nullptr, 0);
+    if (ret) return ret;
+    resolveMapRelos(elf, c.cs);
+
+    string strs;
+    auto addString = [&strs](const string& s) {
+        uint32_t off = strs.size();
+        strs.append(s.c_str(), s.size() + 1);
+        return off;
+    };
+
+    bpfPackHeader h = {};
+    memcpy(h.magic, BPF_PACK_MAGIC, sizeof(h.magic));
+    h.version = BPF_PACK_VERSION;
+    h.flags = c.isCritical ? BPF_PACK_CRITICAL : 0;
+    h.elfSize = elf.size;
+    SHA256(reinterpret_cast<const uint8_t*>(elf.base), elf.size, h.elfSha256);
+    h.mapRecordSize = sizeof(bpfPackMap);
+    h.progRecordSize = sizeof(bpfPackProg);
+    h.licenseOff = addString(c.license);
+    h.criticalOff = addString(c.critical);
+
+    vector<bpfPackMap> maps(c.mapNames.size());
+    for (size_t i = 0; i < maps.size(); i++) {
+        maps[i].nameOff = addString(c.mapNames[i]);
+        maps[i].def = c.md[i];
+    }
+
+    vector<bpfPackProg> progs(c.cs.size());
+    vector<bpfPackRelo> relos;
+    string code;
+    for (size_t i = 0; i < progs.size(); i++) {
+        const codeSection& cs = c.cs[i];
+        progs[i].sectionNameOff = addString(sectionNames[cs.name]);
+        progs[i].hasDef = cs.prog_def.has_value();
+        if (cs.prog_def) progs[i].def = *cs.prog_def;
+        progs[i].codeOff = code.size();
+        progs[i].codeSize = cs.data.size();
+        progs[i].reloIdx = relos.size();
+        progs[i].numRelos = cs.relos.size();
+        for (const auto& relo : cs.relos) {
+            relos.push_back({static_cast<uint32_t>(relo.offset), relo.mapIdx});
+        }
+        append(code, cs.data.data(), cs.data.size());
+    }
+
+    string out(align8(sizeof(h)), '\0');
+    h.numMaps = maps.size();
+    h.mapsOff = out.size();
+    append(out, maps.data(), maps.size());
+    h.numProgs = progs.size();
+    h.progsOff = out.size();
+    append(out, progs.data(), progs.size());
+    h.numRelos = relos.size();
+    h.relosOff = out.size();
+    append(out, relos.data(), relos.size());
+    h.numScaling = c.scaling.size();
+    h.scalingOff = out.size();
+    append(out, c.scaling.data(), c.scaling.size());
+    h.codeOff = out.size();
+    h.codeSize = code.size();
+    out += code;
+    h.strOff = out.size();
+    h.strSize = strs.size();
+    out += strs;
+    memcpy(out.data(), &h, sizeof(h));
+
+    if (!android::base::WriteStringToFile(out, packPath)) {
+        int err = errno;
+        ALOGE("Failed to write %s: %s", packPath, strerror(err));
+        return -err;
+    }
+    return 0;
+}
+
+/*
+ * Whether the object at elfPath is the one the pack was made from. Its hash is compared even on
+ * read-only (ie. verity protected) partitions: a pack and object of the same size can still be
+ * out of sync, eg. when only one of them was updated. This reads all of the object, see the
+ * cost of that in BpfPack.h.
+ */
+static bool packMatchesObject(const char* elfPath, const bpfPackHeader& h) {
+    unique_fd fd(open(elfPath, O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+
+    if (!fd.ok() || fstat(fd, &st) || (uint64_t)st.st_size != h.elfSize) return false;
+    if (!st.st_size) {
+        SHA256(nullptr, 0, digest);
+        return !memcmp(digest, h.elfSha256, sizeof(digest));
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return false;
+    SHA256(static_cast<const uint8_t*>(data), st.st_size, digest);
+    munmap(data, st.st_size);
+    return !memcmp(digest, h.elfSha256, sizeof(digest));
+}
+
+static bool inBounds(const PackObject& pack, uint64_t off, uint64_t count, size_t recordSize) {
+    return off % 8 == 0 && off <= pack.size && count <= (pack.size - off) / recordSize;
+}
+
+int readBpfPack(const char* elfPath, PackObject& out, objectContents& contents,
+                const bpf_prog_type* allowed, size_t numAllowed, const loadEnv* env) {
+    string packPath = string(elfPath) + BPF_PACK_SUFFIX;
+    unique_fd fd(open(packPath.c_str(), O_RDONLY | O_CLOEXEC));
+    PackObject pack;
+    struct stat st;
+
+    if (!fd.ok()) return -errno;
+    if (fstat(fd, &st)) return -errno;
+    if ((size_t)st.st_size < sizeof(bpfPackHeader)) return -EINVAL;
+
+    // Privately writable, like ElfObject: relocation patches the code in place.
+    void* base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) return -errno;
+    pack.base = static_cast<char*>(base);
+    pack.size = st.st_size;
+
+    const bpfPackHeader& h = *reinterpret_cast<const bpfPackHeader*>(pack.base);
+    if (memcmp(h.magic, BPF_PACK_MAGIC, sizeof(h.magic)) || h.version != BPF_PACK_VERSION ||
+        h.mapRecordSize != sizeof(bpfPackMap) || h.progRecordSize != sizeof(bpfPackProg)) {
+        ALOGE("%s: unsupported bpfpack format", packPath.c_str());
+        return -EINVAL;
+    }
+    if (!inBounds(pack, h.mapsOff, h.numMaps, sizeof(bpfPackMap)) ||
+        !inBounds(pack, h.progsOff, h.numProgs, sizeof(bpfPackProg)) ||
+        !inBounds(pack, h.relosOff, h.numRelos, sizeof(bpfPackRelo)) ||
+        !inBounds(pack, h.scalingOff, h.numScaling, sizeof(struct bpf_map_scaling)) ||
+        !inBounds(pack, h.codeOff, h.codeSize, 1) || !inBounds(pack, h.strOff, h.strSize, 1) ||
+        !h.strSize || pack.base[h.strOff + h.strSize - 1]) {
+        ALOGE("%s: corrupt bpfpack", packPath.c_str());
+        return -EINVAL;
+    }
+    if (!packMatchesObject(elfPath, h)) return -ESTALE;
+
+    const char* strs = pack.base + h.strOff;
+    auto getString = [&](uint32_t off, string& s) {
+        if (off >= h.strSize) return false;
+        s = strs + off;
+        return true;
+    };
+
+    objectContents c;
+    c.isCritical = h.flags & BPF_PACK_CRITICAL;
+    if (!getString(h.licenseOff, c.license) || !getString(h.criticalOff, c.critical)) {
+        return -EINVAL;
+    }
+
+    const bpfPackMap* maps = reinterpret_cast<const bpfPackMap*>(pack.base + h.mapsOff);
+    for (uint32_t i = 0; i < h.numMaps; i++) {
+        c.mapNames.emplace_back();
+        if (!getString(maps[i].nameOff, c.mapNames.back())) return -EINVAL;
+        c.md.push_back(maps[i].def);
+    }
+
+    const struct bpf_map_scaling* scaling =
+            reinterpret_cast<const struct bpf_map_scaling*>(pack.base + h.scalingOff);
+    c.scaling.assign(scaling, scaling + h.numScaling);
+    for (auto& s : c.scaling) s.map_name[sizeof(s.map_name) - 1] = '\0';
+
+    const bpfPackProg* progs = reinterpret_cast<const bpfPackProg*>(pack.base + h.progsOff);
+    const bpfPackRelo* relos = reinterpret_cast<const bpfPackRelo*>(pack.base + h.relosOff);
+    for (uint32_t i = 0; i < h.numProgs; i++) {
+        const bpfPackProg& p = progs[i];
+        string sectionName;
+        codeSection cs;
+
+        if (!getString(p.sectionNameOff, sectionName) || p.codeOff % 8 ||
+            p.codeOff > h.codeSize || p.codeSize > h.codeSize - p.codeOff ||
+            p.reloIdx > h.numRelos || p.numRelos > h.numRelos - p.reloIdx) {
+            return -EINVAL;
+        }
+
+        int ret = initCodeSection(sectionName, cs, allowed, numAllowed);
+        if (ret) return ret;
+        if (cs.type == BPF_PROG_TYPE_UNSPEC) return -EINVAL;
+
+        if (env && p.hasDef && excludedBy(p.def, *env)) continue;
+
+        cs.data = sectionView(pack.base + h.codeOff + p.codeOff, p.codeSize);
+        if (p.hasDef) cs.prog_def = p.def;
+        cs.relos.reserve(p.numRelos);
+        for (uint32_t r = p.reloIdx; r < p.reloIdx + p.numRelos; r++) {
+            if (relos[r].mapIdx >= h.numMaps) return -EINVAL;
+            cs.relos.push_back({relos[r].offset, relos[r].mapIdx});
+        }
+        c.cs.push_back(std::move(cs));
+    }
+    if (env) {
+        vector<codeSection> selected;
+        for (size_t i : selectProgVariants(c.cs)) selected.push_back(std::move(c.cs[i]));
+        c.cs = std::move(selected);
+    }
+
+    contents = std::move(c);
+    std::swap(out.base, pack.base);
+    std::swap(out.size, pack.size);
+    return 0;
+}
+
+}  // namespace bpf
+}  // namespace android
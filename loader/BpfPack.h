@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ * Android BPF library - precompiled object contents
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <openssl/sha.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "Loader.h"
+
+/*
+ * A bpfpack is what loading needs from an ELF object, worked out at build time by the bpfpack
+ * host tool: map definitions, names and scaling, program sections with their definitions and
+ * code, and map relocations already resolved to map indices.  It is installed as
+ * <object>.o.pack next to the object and mmap'ed at boot instead of parsing the ELF file.  The
+ * pack records the size and SHA256 of the object it was made from, a pack which doesn't match
+ * its object is ignored and the object is parsed as usual.
+ *
+ * Checking that SHA256 reads the whole object, which costs about as much as parsing it: on an
+ * x86 host with SHA extensions, reading a pack made from a 1.7 MB synthetic object takes 1.5 ms
+ * against 0.6 ms to parse the object (0.4 ms and 0.2 ms at 380 KB).  A pack still saves time
+ * for objects with optional programs, as loading those needs the object's hash for the failure
+ * cache anyway (see setLoadFailureCache) and takes it from the pack.
+ *
+ * Program types are resolved from the section names at load time, as fuse-bpf's program type
+ * is only known to the running kernel (for the same reason, objects with fuse programs can't
+ * be packed).
+ *
+ * Layout, in native byte order, offsets are from the start of the file and 8 byte aligned:
+ *   bpfPackHeader
+ *   bpfPackMap[numMaps]
+ *   bpfPackProg[numProgs]
+ *   bpfPackRelo[numRelos]
+ *   struct bpf_map_scaling[numScaling]
+ *   code of all programs, struct bpf_insn[]
+ *   NUL terminated strings
+ */
+
+#define BPF_PACK_MAGIC "BPFPACK"
+#define BPF_PACK_VERSION 3
+#define BPF_PACK_SUFFIX ".pack"
+
+/* bpfPackHeader flags */
+#define BPF_PACK_CRITICAL 1
+
+namespace android {
+namespace bpf {
+
+struct bpfPackHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t elfSize; /* of the object the pack was made from */
+    uint8_t elfSha256[SHA256_DIGEST_LENGTH]; /* of it */
+    uint32_t mapRecordSize; /* sizeof(bpfPackMap) etc., catches layout changes */
+    uint32_t progRecordSize;
+    uint32_t licenseOff; /* string offsets */
+    uint32_t criticalOff;
+    uint32_t numMaps;
+    uint32_t mapsOff;
+    uint32_t numProgs;
+    uint32_t progsOff;
+    uint32_t numRelos;
+    uint32_t relosOff;
+    uint32_t numScaling;
+    uint32_t scalingOff;
+    uint32_t codeOff;
+    uint32_t codeSize;
+    uint32_t strOff;
+    uint32_t strSize;
+};
+
+struct bpfPackMap {
+    uint32_t nameOff;
+    struct bpf_map_def def;
+};
+
+struct bpfPackProg {
+    uint32_t sectionNameOff;
+    uint32_t hasDef;
+    uint32_t codeOff; /* from the start of the code */
+    uint32_t codeSize;
+    uint32_t reloIdx; /* first of numRelos consecutive relocations */
+    uint32_t numRelos;
+    struct bpf_prog_def def;
+};
+
+struct bpfPackRelo {
+    uint32_t offset; /* from the start of the program's code */
+    uint32_t mapIdx;
+};
+
+/* The mapping of a pack, which the code sections read from it point into */
+struct PackObject {
+    PackObject() = default;
+    PackObject(const PackObject&) = delete;
+    PackObject& operator=(const PackObject&) = delete;
+    ~PackObject() {
+        if (base) munmap(base, size);
+    }
+
+    char* base = nullptr;
+    size_t size = 0;
+};
+
+// The first 8 bytes of the SHA256 of an object, which is what packedHash() gives for the
+// bpfPackHeader.elfSha256 of a pack made from it
+uint64_t hashElfObject(const char* data, size_t size);
+uint64_t packedHash(const uint8_t (&sha256)[SHA256_DIGEST_LENGTH]);
+
+// Returns 0 on success, -errno or -1 on failure. Used by the bpfpack tool.
+int writeBpfPack(const char* elfPath, const char* packPath);
+
+// Read <elfPath>.pack into contents, returns -ENOENT if there is none and -ESTALE if it was made
+// from a different object. pack and contents are only modified on success. With env, programs
+// are pruned as by readCodeSections().
+int readBpfPack(const char* elfPath, PackObject& pack, objectContents& contents,
+                const bpf_prog_type* allowed, size_t numAllowed, const loadEnv* env = nullptr);
+
+}  // namespace bpf
+}  // namespace android
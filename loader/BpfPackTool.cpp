@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "BpfPack.h"
+
+// bpfpack <object.o> <object.o.pack>: precompute what bpfloader needs from an object, see BpfPack.h
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <object.o> <object.o%s>\n", argv[0], BPF_PACK_SUFFIX);
+        return 1;
+    }
+
+    int ret = android::bpf::writeBpfPack(argv[1], argv[2]);
+    if (ret) {
+        fprintf(stderr, "%s: failed to pack %s: %d (%s)\n", argv[0], argv[1], ret,
+                ret < -1 ? strerror(-ret) : "bad object");
+        return 1;
+    }
+    return 0;
+}
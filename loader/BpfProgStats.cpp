@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/bpf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include "BpfSyscallWrappers.h"
+
+#define BPF_FS_PATH "/sys/fs/bpf/"
+
+// Upper bounds on a measurement window and on all of them together: the kernel's run time
+// accounting isn't free
+#define MAX_WINDOW_SECONDS 600
+#define MAX_TOTAL_SECONDS 3600
+
+using android::base::StartsWith;
+using android::base::unique_fd;
+using android::bpf::bpf;
+using android::bpf::ptr_to_u64;
+using android::bpf::retrieveProgram;
+using std::string;
+
+/* A pinned program, programs pinned several times are only listed once */
+struct pinnedProg {
+    string pinPath;
+    unique_fd fd;
+    uint64_t runCnt = 0;
+    uint64_t runTimeNs = 0;
+};
+
+static int getProgInfo(const unique_fd& fd, struct bpf_prog_info& info) {
+    info = {};
+    union bpf_attr req = {
+      .info = {
+        .bpf_fd = static_cast<__u32>(fd.get()),
+        .info_len = sizeof(info),
+        .info = ptr_to_u64(&info),
+      },
+    };
+    return bpf(BPF_OBJ_GET_INFO_BY_FD, req);
+}
+
+/* Recursively find the prog_* pins under dir, ie. including the locations' prefixes */
+static void findPinnedProgs(const string& dir, std::map<uint32_t, pinnedProg>& progs) {
+    DIR* d = opendir(dir.c_str());
+    if (!d) return;
+
+    while (struct dirent* ent = readdir(d)) {
+        string name = ent->d_name;
+        if (name == "." || name == "..") continue;
+
+        string path = dir + name;
+        if (ent->d_type == DT_DIR) {
+            findPinnedProgs(path + "/", progs);
+            continue;
+        }
+        if (!StartsWith(name, "prog_")) continue;
+
+        unique_fd fd(retrieveProgram(path.c_str()));
+        struct bpf_prog_info info;
+        if (!fd.ok() || getProgInfo(fd, info)) {
+            fprintf(stderr, "skipping %s: %s\n", path.c_str(), strerror(errno));
+            continue;
+        }
+        if (progs.count(info.id)) continue;
+
+        pinnedProg& prog = progs[info.id];
+        prog.pinPath = path;
+        prog.fd = std::move(fd);
+    }
+    closedir(d);
+}
+
+/* Print what every program ran during the last window, most expensive first */
+static void reportWindow(std::map<uint32_t, pinnedProg>& progs, int window, int seconds) {
+    struct delta {
+        const pinnedProg* prog;
+        uint64_t runCnt;
+        uint64_t runTimeNs;
+    };
+    std::vector<delta> deltas;
+    uint64_t totalNs = 0;
+
+    for (auto& [id, prog] : progs) {
+        struct bpf_prog_info info;
+        if (getProgInfo(prog.fd, info)) continue;
+
+        deltas.push_back({&prog, info.run_cnt - prog.runCnt, info.run_time_ns - prog.runTimeNs});
+        totalNs += deltas.back().runTimeNs;
+        prog.runCnt = info.run_cnt;
+        prog.runTimeNs = info.run_time_ns;
+    }
+    std::sort(deltas.begin(), deltas.end(),
+              [](const delta& a, const delta& b) { return a.runTimeNs > b.runTimeNs; });
+
+    printf("window=%d seconds=%d programs=%zu run_time_ns=%" PRIu64 " cpu_pct=%.3f\n", window,
+           seconds, deltas.size(), totalNs, totalNs / (seconds * 1e7));
+    for (const auto& d : deltas) {
+        printf("prog=%s run_cnt=%" PRIu64 " run_time_ns=%" PRIu64 " ns_per_run=%" PRIu64 "\n",
+               d.prog->pinPath.c_str(), d.runCnt, d.runTimeNs,
+               d.runCnt ? d.runTimeNs / d.runCnt : 0);
+    }
+    fflush(stdout);
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s [-w seconds] [-n windows] [prefix]\n"
+            "Measure how often and how long the programs pinned under " BPF_FS_PATH
+            "<prefix> run,\n"
+            "over n (default 1) windows of up to %d seconds (default 10) each, %d in total.\n",
+            argv0, MAX_WINDOW_SECONDS, MAX_TOTAL_SECONDS);
+}
+
+// bpfprogstats: enables the kernel's BPF run time statistics (5.8+) for a bounded time and
+// reports the runs of all pinned programs in it, one 'key=value ...' record per line
+int main(int argc, char** argv) {
+    int seconds = 10;
+    int windows = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "w:n:")) != -1) {
+        switch (c) {
+            case 'w':
+                seconds = atoi(optarg);
+                break;
+            case 'n':
+                windows = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (seconds <= 0 || seconds > MAX_WINDOW_SECONDS || windows <= 0 ||
+        windows > MAX_TOTAL_SECONDS / seconds || argc - optind > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    string dir = string(BPF_FS_PATH) + (optind < argc ? argv[optind] : "");
+    if (!dir.ends_with('/')) dir += '/';
+
+    std::map<uint32_t, pinnedProg> progs;  // by program id
+    findPinnedProgs(dir, progs);
+    if (progs.empty()) {
+        fprintf(stderr, "no programs pinned under %s\n", dir.c_str());
+        return 1;
+    }
+
+    // Stats stay enabled for as long as this fd is open (or sysctl kernel.bpf_stats_enabled)
+    union bpf_attr req = {
+      .enable_stats = {
+        .type = BPF_STATS_RUN_TIME,
+      },
+    };
+    unique_fd statsFd(bpf(BPF_ENABLE_STATS, req));
+    if (!statsFd.ok()) {
+        fprintf(stderr, "BPF_ENABLE_STATS: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // Runs before stats were enabled may already be counted, only report what each window adds
+    for (auto& [id, prog] : progs) {
+        struct bpf_prog_info info;
+        if (getProgInfo(prog.fd, info)) continue;
+        prog.runCnt = info.run_cnt;
+        prog.runTimeNs = info.run_time_ns;
+    }
+
+    for (int window = 0; window < windows; window++) {
+        sleep(seconds);
+        reportWindow(progs, window, seconds);
+    }
+    return 0;
+}
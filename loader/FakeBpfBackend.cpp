@@ -0,0 +1,449 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "bpf/BpfUtils.h"
+#include "FakeBpfBackend.h"
+#include "Loader.h"
+
+namespace android {
+namespace bpf {
+
+static int fail(int err) {
+    errno = err;
+    return -1;
+}
+
+template <typename T>
+static T* fromU64(__u64 p) {
+    return reinterpret_cast<T*>(static_cast<uintptr_t>(p));
+}
+
+FakeBpfBackend::FakeBpfBackend(unsigned kernelVersion) : mKernelVersion(kernelVersion) {}
+
+int FakeBpfBackend::bpf(enum bpf_cmd cmd, const union bpf_attr& attr) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mCalls[cmd]++;
+    auto next = mNextErrors.find(cmd);
+    if (next != mNextErrors.end()) {
+        int err = next->second;
+        mNextErrors.erase(next);
+        return fail(err);
+    }
+
+    switch (cmd) {
+        case BPF_MAP_CREATE:
+            return mapCreate(attr);
+        case BPF_PROG_LOAD:
+            return progLoad(attr);
+        case BPF_OBJ_PIN:
+            return objPin(attr);
+        case BPF_OBJ_GET:
+            return objGet(attr);
+        case BPF_OBJ_GET_INFO_BY_FD:
+            return objGetInfo(attr);
+        case BPF_PROG_GET_FD_BY_ID:
+            return progGetFdById(attr);
+        case BPF_MAP_LOOKUP_ELEM:
+        case BPF_MAP_UPDATE_ELEM: {
+            Object* map = getMap(attr.map_fd);
+            if (!map) return -1;
+            const char* key = fromU64<const char>(attr.key);
+            if (cmd == BPF_MAP_LOOKUP_ELEM) return mapLookup(*map, key, fromU64<char>(attr.value));
+            return mapUpdate(*map, key, fromU64<const char>(attr.value));
+        }
+        case BPF_MAP_GET_NEXT_KEY:
+            return mapGetNextKey(attr);
+        case BPF_MAP_LOOKUP_BATCH:
+            return mapLookupBatch(attr);
+        case BPF_MAP_UPDATE_BATCH:
+            return mapUpdateBatch(attr);
+        default:
+            return fail(EINVAL);
+    }
+}
+
+int FakeBpfBackend::newFd(std::shared_ptr<Object> obj) {
+    int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    mFds[fd] = std::move(obj);
+    return fd;
+}
+
+int FakeBpfBackend::mapCreate(const union bpf_attr& attr) {
+    bool ringbuf = attr.map_type == BPF_MAP_TYPE_RINGBUF;
+    unsigned pageSize = getpagesize();
+
+    if (attr.map_type == BPF_MAP_TYPE_DEVMAP_HASH && mKernelVersion < KVER(5, 4, 0)) {
+        return fail(EINVAL);
+    }
+    if (ringbuf && mKernelVersion < KVER(5, 8, 0)) return fail(EINVAL);
+    if (!attr.max_entries) return fail(EINVAL);
+    if (ringbuf) {
+        if (attr.key_size || attr.value_size) return fail(EINVAL);
+        if (attr.max_entries & (attr.max_entries - 1) || attr.max_entries % pageSize) {
+            return fail(EINVAL);
+        }
+    } else if (!attr.key_size || !attr.value_size) {
+        return fail(EINVAL);
+    }
+    auto err = mMapCreateErrors.find(attr.map_name);
+    if (err != mMapCreateErrors.end()) return fail(err->second);
+
+    auto obj = std::make_shared<Object>();
+    obj->isMap = true;
+    obj->mapInfo = {
+        .type = attr.map_type,
+        .id = mNextId++,
+        .key_size = attr.key_size,
+        .value_size = attr.value_size,
+        .max_entries = attr.max_entries,
+        .map_flags = attr.map_flags,
+    };
+    // As dev_map_init_map() does
+    if (attr.map_type == BPF_MAP_TYPE_DEVMAP || attr.map_type == BPF_MAP_TYPE_DEVMAP_HASH) {
+        obj->mapInfo.map_flags |= BPF_F_RDONLY_PROG;
+    }
+    memcpy(obj->mapInfo.name, attr.map_name, sizeof(obj->mapInfo.name));
+
+    mMapCreates++;
+    return newFd(std::move(obj));
+}
+
+int FakeBpfBackend::progLoad(const union bpf_attr& attr) {
+    const struct bpf_insn* insns = fromU64<const struct bpf_insn>(attr.insns);
+    char* log = fromU64<char>(attr.log_buf);
+    std::string name(attr.prog_name, strnlen(attr.prog_name, sizeof(attr.prog_name)));
+
+    if (!insns || !attr.insn_cnt || !attr.license) return fail(EINVAL);
+    if (attr.log_level && (!log || attr.log_size < 128)) return fail(EINVAL);
+
+    // Map references must be map fds, which is what relocation fills in
+    std::vector<__u32> mapIds;
+    int err = 0;
+    for (__u32 i = 0; i < attr.insn_cnt && !err; i++) {
+        if (insns[i].code != (BPF_LD | BPF_IMM | BPF_DW)) continue;
+        if (i + 1 == attr.insn_cnt) {
+            err = EINVAL;
+        } else if (insns[i].src_reg == BPF_PSEUDO_MAP_FD) {
+            auto it = mFds.find(insns[i].imm);
+            if (it == mFds.end() || !it->second->isMap) {
+                err = EBADF;
+            } else if (std::find(mapIds.begin(), mapIds.end(), it->second->mapInfo.id) ==
+                       mapIds.end()) {
+                mapIds.push_back(it->second->mapInfo.id);
+            }
+        }
+        i++;
+    }
+    if (!err && mProgLoadErrors.count(name)) err = mProgLoadErrors[name];
+
+    mProgLoads++;
+    if (err) {
+        if (attr.log_level) {
+            snprintf(log, attr.log_size, "fake verifier: rejecting %s: %s\n", name.c_str(),
+                     strerror(err));
+        }
+        return fail(err);
+    }
+
+    auto obj = std::make_shared<Object>();
+    obj->isMap = false;
+    obj->insns.assign(insns, insns + attr.insn_cnt);
+    obj->mapIds = std::move(mapIds);
+    obj->progInfo = {
+        .type = attr.prog_type,
+        .id = mNextId++,
+        .xlated_prog_len = static_cast<__u32>(attr.insn_cnt * sizeof(struct bpf_insn)),
+    };
+    memcpy(obj->progInfo.name, attr.prog_name, sizeof(obj->progInfo.name));
+    calcProgTag(insns, attr.insn_cnt, false, obj->progInfo.tag);
+    if (attr.log_level & 4) {  // BPF_LOG_STATS, as if the verifier walked every insn once
+        snprintf(log, attr.log_size,
+                 "verification time %u usec\nstack depth 0\nprocessed %u insns (limit 1000000) "
+                 "max_states_per_insn 0 total_states %u peak_states %u mark_read 0\n",
+                 attr.insn_cnt, attr.insn_cnt, attr.insn_cnt / 2, attr.insn_cnt / 2);
+    }
+    return newFd(std::move(obj));
+}
+
+int FakeBpfBackend::objPin(const union bpf_attr& attr) {
+    std::string path = fromU64<const char>(attr.pathname);
+    auto it = mFds.find(attr.bpf_fd);
+
+    if (it == mFds.end()) return fail(EBADF);
+    if (mPins.count(path)) return fail(EEXIST);
+    mPins[path] = {.obj = it->second, .mode = 0600, .uid = 0, .gid = 0};
+    return 0;
+}
+
+int FakeBpfBackend::objGet(const union bpf_attr& attr) {
+    auto it = mPins.find(fromU64<const char>(attr.pathname));
+
+    if (it == mPins.end()) return fail(ENOENT);
+    return newFd(it->second.obj);
+}
+
+int FakeBpfBackend::progGetFdById(const union bpf_attr& attr) {
+    // Programs are alive while they have fds or pins (fds may be stale, which is good enough)
+    for (const auto& [fd, obj] : mFds) {
+        if (!obj->isMap && obj->progInfo.id == attr.prog_id) return newFd(obj);
+    }
+    for (const auto& [path, pin] : mPins) {
+        if (!pin.obj->isMap && pin.obj->progInfo.id == attr.prog_id) return newFd(pin.obj);
+    }
+    return fail(ENOENT);
+}
+
+int FakeBpfBackend::objGetInfo(const union bpf_attr& attr) {
+    auto it = mFds.find(attr.info.bpf_fd);
+    if (it == mFds.end()) return fail(EBADF);
+
+    const Object& obj = *it->second;
+    if (obj.isMap) {
+        memcpy(fromU64<void>(attr.info.info), &obj.mapInfo,
+               std::min<size_t>(attr.info.info_len, sizeof(obj.mapInfo)));
+    } else {
+        // As the kernel, fill in as many map ids as the caller has room for
+        struct bpf_prog_info* info = fromU64<struct bpf_prog_info>(attr.info.info);
+        struct bpf_prog_info progInfo = obj.progInfo;
+        if (attr.info.info_len >= sizeof(progInfo)) {
+            __u32* ids = fromU64<__u32>(info->map_ids);
+            for (size_t i = 0; ids && i < std::min<size_t>(info->nr_map_ids, obj.mapIds.size());
+                 i++) {
+                ids[i] = obj.mapIds[i];
+            }
+            progInfo.map_ids = info->map_ids;
+        }
+        progInfo.nr_map_ids = obj.mapIds.size();
+        memcpy(info, &progInfo, std::min<size_t>(attr.info.info_len, sizeof(progInfo)));
+    }
+    return 0;
+}
+
+FakeBpfBackend::Object* FakeBpfBackend::getMap(__u32 fd) {
+    auto it = mFds.find(fd);
+    if (it == mFds.end()) return fail(EBADF), nullptr;
+    if (!it->second->isMap) return fail(EINVAL), nullptr;
+    return it->second.get();
+}
+
+static bool isArrayMap(const struct bpf_map_info& info) {
+    return info.type == BPF_MAP_TYPE_ARRAY || info.type == BPF_MAP_TYPE_PERCPU_ARRAY;
+}
+
+int FakeBpfBackend::mapLookup(Object& map, const char* key, char* value) {
+    auto it = map.entries.find(std::string(key, map.mapInfo.key_size));
+    if (it == map.entries.end()) {
+        if (!isArrayMap(map.mapInfo)) return fail(ENOENT);
+        // Arrays have all their entries, zeroed until written
+        __u32 idx;
+        memcpy(&idx, key, sizeof(idx));
+        if (idx >= map.mapInfo.max_entries) return fail(ENOENT);
+        memset(value, 0, map.mapInfo.value_size);
+        return 0;
+    }
+    memcpy(value, it->second.data(), it->second.size());
+    return 0;
+}
+
+int FakeBpfBackend::mapUpdate(Object& map, const char* key, const char* value) {
+    std::string k(key, map.mapInfo.key_size);
+
+    if (isArrayMap(map.mapInfo)) {
+        __u32 idx;
+        memcpy(&idx, key, sizeof(idx));
+        if (idx >= map.mapInfo.max_entries) return fail(E2BIG);
+    } else if (!map.entries.count(k) && map.entries.size() >= map.mapInfo.max_entries) {
+        return fail(E2BIG);
+    }
+    map.entries[k] = std::string(value, map.mapInfo.value_size);
+    return 0;
+}
+
+int FakeBpfBackend::mapGetNextKey(const union bpf_attr& attr) {
+    Object* map = getMap(attr.map_fd);
+    if (!map) return -1;
+
+    auto it = map->entries.begin();
+    if (attr.key) {
+        it = map->entries.upper_bound(std::string(fromU64<const char>(attr.key),
+                                                  map->mapInfo.key_size));
+    }
+    if (it == map->entries.end()) return fail(ENOENT);
+    memcpy(fromU64<char>(attr.next_key), it->first.data(), it->first.size());
+    return 0;
+}
+
+// Batches are positions in key order: in_batch/out_batch hold the number of entries done
+int FakeBpfBackend::mapLookupBatch(const union bpf_attr& attr) {
+    Object* map = getMap(attr.batch.map_fd);
+    if (!map) return -1;
+    if (!attr.batch.count) return fail(EINVAL);
+
+    __u32 pos = 0;
+    if (attr.batch.in_batch) memcpy(&pos, fromU64<char>(attr.batch.in_batch), sizeof(pos));
+
+    auto it = map->entries.begin();
+    std::advance(it, std::min<size_t>(pos, map->entries.size()));
+    char* keys = fromU64<char>(attr.batch.keys);
+    char* values = fromU64<char>(attr.batch.values);
+    __u32 n = 0;
+    for (; it != map->entries.end() && n < attr.batch.count; it++, n++) {
+        memcpy(keys + n * map->mapInfo.key_size, it->first.data(), it->first.size());
+        memcpy(values + n * map->mapInfo.value_size, it->second.data(), it->second.size());
+    }
+
+    // The kernel writes the count back into the caller's attr, const or not
+    const_cast<union bpf_attr&>(attr).batch.count = n;
+    pos += n;
+    memcpy(fromU64<char>(attr.batch.out_batch), &pos, sizeof(pos));
+    return it == map->entries.end() ? fail(ENOENT) : 0;
+}
+
+int FakeBpfBackend::mapUpdateBatch(const union bpf_attr& attr) {
+    Object* map = getMap(attr.batch.map_fd);
+    if (!map) return -1;
+
+    const char* keys = fromU64<const char>(attr.batch.keys);
+    const char* values = fromU64<const char>(attr.batch.values);
+    for (__u32 n = 0; n < attr.batch.count; n++) {
+        if (mapUpdate(*map, keys + n * map->mapInfo.key_size,
+                      values + n * map->mapInfo.value_size)) {
+            const_cast<union bpf_attr&>(attr).batch.count = n;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int FakeBpfBackend::access(const char* path, int) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return mPins.count(path) ? 0 : fail(ENOENT);
+}
+
+int FakeBpfBackend::chmod(const char* path, mode_t mode) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mPins.find(path);
+    if (it == mPins.end()) return fail(ENOENT);
+    it->second.mode = mode;
+    return 0;
+}
+
+int FakeBpfBackend::chown(const char* path, uid_t uid, gid_t gid) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mPins.find(path);
+    if (it == mPins.end()) return fail(ENOENT);
+    it->second.uid = uid;
+    it->second.gid = gid;
+    return 0;
+}
+
+int FakeBpfBackend::unlink(const char* path) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return mPins.erase(path) ? 0 : fail(ENOENT);
+}
+
+int FakeBpfBackend::rename(const char* from, const char* to) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mPins.find(from);
+    if (it == mPins.end()) return fail(ENOENT);
+    Pin pin = it->second;
+    mPins.erase(it);
+    mPins[to] = pin;
+    return 0;
+}
+
+int FakeBpfBackend::dup(int fd) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mFds.find(fd);
+    if (it == mFds.end()) return fail(EBADF);
+    return newFd(it->second);
+}
+
+void FakeBpfBackend::failProgLoad(const std::string& progName, int err) {
+    if (progName.size() >= BPF_OBJ_NAME_LEN) abort();
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mProgLoadErrors[progName] = err;
+}
+
+void FakeBpfBackend::failMapCreate(const std::string& mapName, int err) {
+    if (mapName.size() >= BPF_OBJ_NAME_LEN) abort();
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mMapCreateErrors[mapName] = err;
+}
+
+void FakeBpfBackend::failNext(enum bpf_cmd cmd, int err) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mNextErrors[cmd] = err;
+}
+
+std::string FakeBpfBackend::getProperty(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto it = mProperties.find(name);
+    return it == mProperties.end() ? "" : it->second;
+}
+
+void FakeBpfBackend::setProperty(const std::string& name, const std::string& value) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mProperties[name] = value;
+}
+
+std::map<std::string, FakeBpfBackend::Pin> FakeBpfBackend::pins() {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return mPins;
+}
+
+int FakeBpfBackend::mapCreates() {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return mMapCreates;
+}
+
+int FakeBpfBackend::progLoads() {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return mProgLoads;
+}
+
+int FakeBpfBackend::calls(enum bpf_cmd cmd) {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    return mCalls[cmd];
+}
+
+}  // namespace bpf
+}  // namespace android
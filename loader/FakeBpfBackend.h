@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ * Android BPF library - in-process fake of the kernel bpf interface
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "BpfBackend.h"
+
+namespace android {
+namespace bpf {
+
+/*
+ * A BpfBackend that keeps maps, programs and an in-memory bpffs to itself, so that the loader
+ * can be run (and tested and benchmarked) on hosts without bpf support or privileges.
+ *
+ * It implements BPF_MAP_CREATE, BPF_PROG_LOAD, BPF_OBJ_PIN, BPF_OBJ_GET,
+ * BPF_OBJ_GET_INFO_BY_FD, BPF_PROG_GET_FD_BY_ID and the element and batch operations on maps
+ * with the argument checks and errors of the kernel that the loader relies on, but does not
+ * verify programs. Map entries are plain key/value bytes, per-CPU maps have a single value.
+ * Every object fd it hands out is a real fd (of /dev/null), so callers can close them as usual.
+ */
+class FakeBpfBackend : public BpfBackend {
+  public:
+    struct Object {
+        bool isMap;
+        struct bpf_map_info mapInfo;
+        struct bpf_prog_info progInfo;
+        std::vector<struct bpf_insn> insns;  // programs only, as loaded
+        std::vector<__u32> mapIds;           // programs only, of the maps they reference
+        std::map<std::string, std::string> entries;  // maps only, key -> value
+    };
+
+    struct Pin {
+        std::shared_ptr<Object> obj;
+        mode_t mode;
+        uid_t uid;
+        gid_t gid;
+    };
+
+    explicit FakeBpfBackend(unsigned kernelVersion);
+
+    int bpf(enum bpf_cmd cmd, const union bpf_attr& attr) override;
+    int access(const char* path, int mode) override;
+    int chmod(const char* path, mode_t mode) override;
+    int chown(const char* path, uid_t uid, gid_t gid) override;
+    int unlink(const char* path) override;
+    int rename(const char* from, const char* to) override;
+    int dup(int fd) override;
+    unsigned kernelVersion() override { return mKernelVersion; }
+    std::string getProperty(const std::string& name) override;
+
+    // Makes every BPF_PROG_LOAD of a program with this name fail with err. Like the kernel, the
+    // fake only gets the first BPF_OBJ_NAME_LEN - 1 characters of a program's name, so progName
+    // must be shorter than BPF_OBJ_NAME_LEN: eg. "tracepoint_prog" is every tracepoint_prog_N.
+    void failProgLoad(const std::string& progName, int err);
+
+    // Makes every BPF_MAP_CREATE of a map with this name (shorter than BPF_OBJ_NAME_LEN, it is
+    // all the kernel gets) fail with err
+    void failMapCreate(const std::string& mapName, int err);
+
+    // Makes the next bpf() call with cmd fail with err
+    void failNext(enum bpf_cmd cmd, int err);
+
+    // Sets a system property, as seen by the loader through getProperty()
+    void setProperty(const std::string& name, const std::string& value);
+
+    // Snapshot of the fake bpffs, by path
+    std::map<std::string, Pin> pins();
+
+    int mapCreates();
+    int progLoads();
+    // How often bpf() was called with cmd
+    int calls(enum bpf_cmd cmd);
+
+  private:
+    int newFd(std::shared_ptr<Object> obj);
+    int mapCreate(const union bpf_attr& attr);
+    int progLoad(const union bpf_attr& attr);
+    int objPin(const union bpf_attr& attr);
+    int objGet(const union bpf_attr& attr);
+    int objGetInfo(const union bpf_attr& attr);
+    int progGetFdById(const union bpf_attr& attr);
+    Object* getMap(__u32 fd);
+    int mapLookup(Object& map, const char* key, char* value);
+    int mapUpdate(Object& map, const char* key, const char* value);
+    int mapGetNextKey(const union bpf_attr& attr);
+    int mapLookupBatch(const union bpf_attr& attr);
+    int mapUpdateBatch(const union bpf_attr& attr);
+
+    const unsigned mKernelVersion;
+
+    std::mutex mMutex;
+    std::map<int, std::shared_ptr<Object>> mFds;  // stale once closed, until the fd is reused
+    std::map<std::string, Pin> mPins;
+    std::map<std::string, int> mProgLoadErrors;
+    std::map<std::string, int> mMapCreateErrors;
+    std::map<int, int> mNextErrors;  // by command
+    std::map<std::string, std::string> mProperties;
+    uint32_t mNextId = 1;
+    int mMapCreates = 0;
+    int mProgLoads = 0;
+    std::map<int, int> mCalls;  // by command
+};
+
+}  // namespace bpf
+}  // namespace android
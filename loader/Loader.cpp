@@ -18,6 +18,8 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <linux/bpf.h>
 #include <linux/elf.h>
 #include <log/log.h>
@@ -26,33 +28,63 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "BpfBackend.h"
+#include "BpfPack.h"
 #include "BpfSyscallWrappers.h"
 #include "bpf/BpfUtils.h"
 #include "bpf/bpf_map_def.h"
 #include "include/libbpf_android.h"
+#include "Loader.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdlib>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <android-base/cmsg.h>
 #include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/properties.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
+#include <openssl/sha.h>
 
 #define BPF_FS_PATH "/sys/fs/bpf/"
 
-// Size of the BPF log buffer for verifier logging
+// Size of the BPF log buffer for verifier logging, which starts out at
+// BPF_LOAD_LOG_MIN_SZ and doubles as long as the log doesn't fit
 #define BPF_LOAD_LOG_SZ 0xfffff
+#define BPF_LOAD_LOG_MIN_SZ 0x10000
+
+// BPF_PROG_LOAD log_level bits (the kernel's BPF_LOG_LEVEL1 and BPF_LOG_STATS), statistics
+// only need a small buffer (the kernel's minimum is 128 bytes)
+#define BPF_LOAD_LOG_VERBOSE 1
+#define BPF_LOAD_LOG_STATS 4
+#define BPF_LOAD_STATS_LOG_SZ 0x400
+
+// Upper bound on concurrent BPF_PROG_LOAD verifier runs for one object
+#define BPF_LOAD_MAX_THREADS 8
 
 // Unspecified attach type is 0 which is BPF_CGROUP_INET_INGRESS.
 #define BPF_ATTACH_TYPE_UNSPEC BPF_CGROUP_INET_INGRESS
@@ -70,6 +102,194 @@ namespace bpf {
 
 static unsigned int page_size = static_cast<unsigned int>(getpagesize());
 
+/* Adds the CLOCK_MONOTONIC time it was alive for, in microseconds, to a LoadTimings field */
+class ScopedTiming {
+  public:
+    explicit ScopedTiming(int64_t& totalUs)
+        : mTotalUs(totalUs), mStart(std::chrono::steady_clock::now()) {}
+    ~ScopedTiming() {
+        auto elapsed = std::chrono::steady_clock::now() - mStart;
+        mTotalUs += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    }
+
+  private:
+    int64_t& mTotalUs;
+    std::chrono::steady_clock::time_point mStart;
+};
+
+/* The running kernel */
+class KernelBpfBackend : public BpfBackend {
+  public:
+    int bpf(enum bpf_cmd cmd, const union bpf_attr& attr) override {
+        return android::bpf::bpf(cmd, attr);
+    }
+    int access(const char* path, int mode) override { return ::access(path, mode); }
+    int chmod(const char* path, mode_t mode) override { return ::chmod(path, mode); }
+    int chown(const char* path, uid_t uid, gid_t gid) override { return ::chown(path, uid, gid); }
+    int unlink(const char* path) override { return ::unlink(path); }
+    int rename(const char* from, const char* to) override { return ::rename(from, to); }
+    int dup(int fd) override { return fcntl(fd, F_DUPFD_CLOEXEC, 0); }
+    unsigned kernelVersion() override { return android::bpf::kernelVersion(); }
+    std::string getProperty(const std::string& name) override {
+        return android::base::GetProperty(name, "");
+    }
+};
+
+static BpfBackend* sBackend = nullptr;
+
+BpfBackend& getBpfBackend() {
+    static KernelBpfBackend kernel;
+    return sBackend ? *sBackend : kernel;
+}
+
+// The BpfSyscallWrappers.h helpers the loader needs, issued through getBpfBackend() instead
+static int pinObject(const unique_fd& fd, const char* pathname) {
+    union bpf_attr req = {
+      .pathname = ptr_to_u64(pathname),
+      .bpf_fd = static_cast<__u32>(fd.get()),
+    };
+    return getBpfBackend().bpf(BPF_OBJ_PIN, req);
+}
+
+static int retrieveObjectRO(const char* pathname) {
+    union bpf_attr req = {
+      .pathname = ptr_to_u64(pathname),
+      .file_flags = BPF_F_RDONLY,
+    };
+    return getBpfBackend().bpf(BPF_OBJ_GET, req);
+}
+
+// All the kernel has to say about a map or program fd in one BPF_OBJ_GET_INFO_BY_FD: callers
+// fetch it once per fd and read every field they need from it, rather than one call per field.
+template <typename T>
+static int getObjectInfo(int fd, T& info) {
+    info = {};
+    union bpf_attr req = {
+      .info = {
+        .bpf_fd = static_cast<__u32>(fd),
+        .info_len = sizeof(info),
+        .info = ptr_to_u64(&info),
+      },
+    };
+    return getBpfBackend().bpf(BPF_OBJ_GET_INFO_BY_FD, req);
+}
+
+/*
+ * The answers to everything the loader asks of the kernel, beyond bpf() itself. Probed once
+ * per process (or per backend, see setBpfBackend) instead of on every decision: the kernel
+ * version and fuse-bpf's program type up front, map and program type support lazily, on first
+ * use. Safe to use from concurrent loads.
+ */
+class kernelProbe {
+  public:
+    explicit kernelProbe(BpfBackend& backend) : mBackend(backend) {
+        mKernelVersion = backend.kernelVersion();
+
+        // TODO Remove this code when fuse-bpf is upstream and this BPF_PROG_TYPE_FUSE is fixed
+        int fuseType = BPF_PROG_TYPE_UNSPEC;
+        ifstream("/sys/fs/fuse/bpf_prog_type_fuse") >> fuseType;
+        mFuseProgType = static_cast<bpf_prog_type>(fuseType);
+
+        ALOGI("kernel 0x%x, fuse prog type %d", mKernelVersion, mFuseProgType);
+    }
+
+    unsigned kernelVersion() const { return mKernelVersion; }
+    enum bpf_prog_type fuseProgType() const { return mFuseProgType; }
+
+    // Whether the kernel knows the map type: creating a minimal map of it fails with EINVAL
+    // only for unknown types (anything else, ie. EPERM, is taken as supported).
+    bool mapTypeSupported(enum bpf_map_type type) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mMapTypes.find(type);
+        if (it != mMapTypes.end()) return it->second;
+
+        bool ringbuf = type == BPF_MAP_TYPE_RINGBUF;
+        union bpf_attr req = {
+          .map_type = type,
+          .key_size = ringbuf ? 0u : 4u,
+          .value_size = ringbuf ? 0u : 4u,
+          .max_entries = ringbuf ? page_size : 1u,
+        };
+        unique_fd fd(mBackend.bpf(BPF_MAP_CREATE, req));
+        bool supported = fd.ok() || errno != EINVAL;
+
+        ALOGD("probed map type %d: %s", type, supported ? "supported" : "unsupported");
+        return mMapTypes[type] = supported;
+    }
+
+    // As above, for program types: loads 'r0 = 0; exit'.
+    bool progTypeSupported(enum bpf_prog_type type, enum bpf_attach_type attachType) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto key = std::make_pair(type, attachType);
+        auto it = mProgTypes.find(key);
+        if (it != mProgTypes.end()) return it->second;
+
+        static const struct bpf_insn insns[] = {
+            {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0},
+            {.code = BPF_JMP | BPF_EXIT},
+        };
+        union bpf_attr req = {
+          .prog_type = type,
+          .insn_cnt = 2,
+          .insns = ptr_to_u64(insns),
+          .license = ptr_to_u64("GPL"),
+          .kern_version = mKernelVersion,
+          .expected_attach_type = attachType,
+        };
+        unique_fd fd(mBackend.bpf(BPF_PROG_LOAD, req));
+        bool supported = fd.ok() || errno != EINVAL;
+
+        ALOGD("probed prog type %d: %s", type, supported ? "supported" : "unsupported");
+        return mProgTypes[key] = supported;
+    }
+
+  private:
+    BpfBackend& mBackend;
+    unsigned mKernelVersion;
+    enum bpf_prog_type mFuseProgType;
+
+    std::mutex mMutex;
+    std::map<enum bpf_map_type, bool> mMapTypes;
+    std::map<std::pair<enum bpf_prog_type, enum bpf_attach_type>, bool> mProgTypes;
+};
+
+static std::mutex sProbeMutex;
+static std::unique_ptr<kernelProbe> sProbe;
+
+static kernelProbe& getKernelProbe() {
+    std::lock_guard<std::mutex> lock(sProbeMutex);
+    if (!sProbe) sProbe = std::make_unique<kernelProbe>(getBpfBackend());
+    return *sProbe;
+}
+
+static loadEnv getLoadEnv() {
+    static const string buildType = android::base::GetProperty("ro.build.type", "");
+    return {getKernelProbe().kernelVersion(), buildType};
+}
+
+static void clearRegistries();
+
+void setBpfBackend(BpfBackend* backend) {
+    clearRegistries();  // of objects of the previous backend
+    sBackend = backend;
+    std::lock_guard<std::mutex> lock(sProbeMutex);
+    sProbe.reset();  // probed a different kernel
+}
+
+/* Map types which can stand in for ones the kernel lacks */
+static const struct {
+    enum bpf_map_type type;
+    enum bpf_map_type fallback;
+} mapTypeFallbacks[] = {
+        // DEVMAP_HASH (5.4+) can kind of be approximated: HASH has the same userspace visible
+        // api. However it cannot be used by ebpf programs in the same way. Since
+        // bpf_redirect_map() only requires 4.14, a program using a DEVMAP_HASH map would fail
+        // to load (due to trying to redirect to a HASH instead of DEVMAP_HASH).
+        // One must thus tag any BPF_MAP_TYPE_DEVMAP_HASH + bpf_redirect_map() using
+        // programs as being 5.4+...
+        {BPF_MAP_TYPE_DEVMAP_HASH, BPF_MAP_TYPE_HASH},
+};
+
 static string pathToObjName(const string& path) {
     // extract everything after the final slash, ie. this is the filename 'foo@1.o' or 'bar.o'
     string filename = android::base::Split(path, "/").back();
@@ -106,121 +326,180 @@ sectionType sectionNameTypes[] = {
         {"uretprobe/",     BPF_PROG_TYPE_KPROBE,           BPF_ATTACH_TYPE_UNSPEC},
 };
 
-typedef struct {
-    enum bpf_prog_type type;
-    enum bpf_attach_type expected_attach_type;
-    string name;
-    vector<char> data;
-    vector<char> rel_data;
-    optional<struct bpf_prog_def> prog_def;
+/* Read a section by its index - for ex to get sec hdr strtab blob */
+static int readSectionByIdx(const ElfObject& elf, int id, sectionView& sec) {
+    if (id < 0 || id >= elf.shnum) return -1;
 
-    unique_fd prog_fd; /* fd after loading */
-} codeSection;
+    const Elf64_Shdr& sh = elf.shTable[id];
+    if (sh.sh_type == SHT_NOBITS) {
+        sec = sectionView();
+        return 0;
+    }
+    if (sh.sh_offset > elf.size || sh.sh_size > elf.size - sh.sh_offset) return -1;
 
-static int readElfHeader(ifstream& elfFile, Elf64_Ehdr* eh) {
-    elfFile.seekg(0);
-    if (elfFile.fail()) return -1;
+    sec = sectionView(elf.base + sh.sh_offset, sh.sh_size);
+    return 0;
+}
 
-    if (!elfFile.read((char*)eh, sizeof(*eh))) return -1;
+/* Read a string table, which must be NUL terminated */
+static int readStrtab(const ElfObject& elf, int id, sectionView& strtab) {
+    int ret = readSectionByIdx(elf, id, strtab);
+    if (ret) return ret;
 
+    if (!strtab.size() || strtab.data()[strtab.size() - 1] != '\0') return -1;
     return 0;
 }
 
-/* Reads all section header tables into an Shdr array */
-static int readSectionHeadersAll(ifstream& elfFile, vector<Elf64_Shdr>& shTable) {
-    Elf64_Ehdr eh;
-    int ret = 0;
-
-    ret = readElfHeader(elfFile, &eh);
-    if (ret) return ret;
+static bool symCompare(const Elf64_Sym& a, const Elf64_Sym& b) {
+    return (a.st_value < b.st_value);
+}
 
-    elfFile.seekg(eh.e_shoff);
-    if (elfFile.fail()) return -1;
+/* Index an object already mapped or buffered at elf.base */
+static int indexElfObject(ElfObject& elf) {
+    int ret;
 
-    /* Read shdr table entries */
-    shTable.resize(eh.e_shnum);
+    if (elf.size < sizeof(elf.header)) return -1;
+    memcpy(&elf.header, elf.base, sizeof(elf.header));
 
-    if (!elfFile.read((char*)shTable.data(), (eh.e_shnum * eh.e_shentsize))) return -ENOMEM;
+    const Elf64_Ehdr& eh = elf.header;
+    if (eh.e_shentsize != sizeof(Elf64_Shdr)) return -1;
+    if (eh.e_shoff % alignof(Elf64_Shdr)) return -1;
+    if (eh.e_shoff > elf.size || (size_t)eh.e_shnum * eh.e_shentsize > elf.size - eh.e_shoff)
+        return -1;
 
-    return 0;
-}
+    elf.shTable = (const Elf64_Shdr*)(elf.base + eh.e_shoff);
+    elf.shnum = eh.e_shnum;
 
-/* Read a section by its index - for ex to get sec hdr strtab blob */
-static int readSectionByIdx(ifstream& elfFile, int id, vector<char>& sec) {
-    vector<Elf64_Shdr> shTable;
-    int ret = readSectionHeadersAll(elfFile, shTable);
+    ret = readStrtab(elf, eh.e_shstrndx, elf.shStrtab);
     if (ret) return ret;
 
-    elfFile.seekg(shTable[id].sh_offset);
-    if (elfFile.fail()) return -1;
+    for (int i = 0; i < elf.shnum; i++) {
+        if (elf.shTable[i].sh_name >= elf.shStrtab.size()) return -1;
+        // first match wins, like a linear scan would
+        elf.sectionIdx.emplace(elf.shStrtab.data() + elf.shTable[i].sh_name, i);
+    }
 
-    sec.resize(shTable[id].sh_size);
-    if (!elfFile.read(sec.data(), shTable[id].sh_size)) return -1;
+    elf.sectionSyms.resize(elf.shnum);
 
-    return 0;
-}
+    int symtabIdx = -1;
+    for (int i = 0; i < elf.shnum; i++) {
+        if (elf.shTable[i].sh_type == SHT_SYMTAB) {
+            symtabIdx = i;
+            break;
+        }
+    }
+    if (symtabIdx == -1) return 0;  // no symbols, lookups will simply find nothing
 
-/* Read whole section header string table */
-static int readSectionHeaderStrtab(ifstream& elfFile, vector<char>& strtab) {
-    Elf64_Ehdr eh;
-    int ret = readElfHeader(elfFile, &eh);
+    sectionView secData;
+    ret = readSectionByIdx(elf, symtabIdx, secData);
     if (ret) return ret;
+    if ((secData.data() - elf.base) % alignof(Elf64_Sym)) return -1;
 
-    ret = readSectionByIdx(elfFile, eh.e_shstrndx, strtab);
+    elf.symtab = (const Elf64_Sym*)secData.data();
+    elf.symnum = secData.size() / sizeof(Elf64_Sym);
+
+    // Symbol names live in the string table linked from the symtab section header,
+    // which for clang built objects is the same table as the section header names.
+    ret = readStrtab(elf, elf.shTable[symtabIdx].sh_link, elf.strtab);
     if (ret) return ret;
 
+    for (int i = 0; i < elf.symnum; i++) {
+        int shndx = elf.symtab[i].st_shndx;
+        if (shndx < elf.shnum) elf.sectionSyms[shndx].push_back(i);
+    }
+    for (auto& syms : elf.sectionSyms) {
+        std::stable_sort(syms.begin(), syms.end(), [&elf](int a, int b) {
+            return symCompare(elf.symtab[a], elf.symtab[b]);
+        });
+    }
+
     return 0;
 }
 
-/* Get name from offset in strtab */
-static int getSymName(ifstream& elfFile, int nameOff, string& name) {
-    int ret;
-    vector<char> secStrTab;
+/* Map an ELF object file copy-on-write and index it */
+int mapElfObject(const char* elfPath, ElfObject& elf) {
+    unique_fd fd(open(elfPath, O_RDONLY | O_CLOEXEC));
+    if (!fd.ok()) return -errno;
 
-    ret = readSectionHeaderStrtab(elfFile, secStrTab);
-    if (ret) return ret;
+    struct stat st;
+    if (fstat(fd, &st)) return -errno;
+    if (st.st_size <= 0) return -1;
 
-    if (nameOff >= (int)secStrTab.size()) return -1;
+    // MAP_PRIVATE + PROT_WRITE: relocations patch code in place, and only the pages they
+    // touch get copied, everything else is shared with the page cache.
+    void* addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) return -errno;
 
-    name = string((char*)secStrTab.data() + nameOff);
-    return 0;
+    elf.base = (char*)addr;
+    elf.size = st.st_size;
+    elf.mapped = true;
+
+    return indexElfObject(elf);
 }
 
-/* Reads a full section by name - example to get the GPL license */
-static int readSectionByName(const char* name, ifstream& elfFile, vector<char>& data) {
-    vector<char> secStrTab;
-    vector<Elf64_Shdr> shTable;
-    int ret;
+/* Read a whole ELF object from a stream and index it */
+static int readElfObject(ifstream& elfFile, ElfObject& elf) {
+    elfFile.seekg(0, ios::end);
+    if (elfFile.fail()) return -1;
+    std::streamoff len = elfFile.tellg();
+    if (len <= 0) return -1;
 
-    ret = readSectionHeadersAll(elfFile, shTable);
-    if (ret) return ret;
+    elfFile.seekg(0);
+    if (elfFile.fail()) return -1;
 
-    ret = readSectionHeaderStrtab(elfFile, secStrTab);
-    if (ret) return ret;
+    elf.buffer.resize(len);
+    if (!elfFile.read(elf.buffer.data(), len)) return -1;
 
-    for (int i = 0; i < (int)shTable.size(); i++) {
-        char* secname = secStrTab.data() + shTable[i].sh_name;
-        if (!secname) continue;
+    elf.base = elf.buffer.data();
+    elf.size = elf.buffer.size();
 
-        if (!strcmp(secname, name)) {
-            vector<char> dataTmp;
-            dataTmp.resize(shTable[i].sh_size);
+    return indexElfObject(elf);
+}
 
-            elfFile.seekg(shTable[i].sh_offset);
-            if (elfFile.fail()) return -1;
+/* Get section index from its name, -1 if there is no such section */
+static int getSectionIdx(const ElfObject& elf, const string& name) {
+    auto it = elf.sectionIdx.find(name);
+    return it == elf.sectionIdx.end() ? -1 : it->second;
+}
 
-            if (!elfFile.read((char*)dataTmp.data(), shTable[i].sh_size)) return -1;
+/* Get the name of a section from its index */
+static int getSectionNameByIdx(const ElfObject& elf, int id, string& name) {
+    if (id < 0 || id >= elf.shnum) return -1;
 
-            data = dataTmp;
-            return 0;
-        }
-    }
-    return -2;
+    name = string(elf.shStrtab.data() + elf.shTable[id].sh_name);
+    return 0;
 }
 
-unsigned int readSectionUint(const char* name, ifstream& elfFile, unsigned int defVal) {
-    vector<char> theBytes;
-    int ret = readSectionByName(name, elfFile, theBytes);
+/* Get name from offset in strtab */
+static int getSymName(const ElfObject& elf, int nameOff, string& name) {
+    if (nameOff < 0 || nameOff >= (int)elf.strtab.size()) return -1;
+
+    name = string(elf.strtab.data() + nameOff);
+    return 0;
+}
+
+int readSectionByName(const char* name, const ElfObject& elf, sectionView& data) {
+    int id = getSectionIdx(elf, name);
+    if (id == -1) return -2;
+
+    return readSectionByIdx(elf, id, data);
+}
+
+/* decode the first 4 bytes as LE32 uint, there will likely be more bytes due to alignment */
+static unsigned int decodeLe32(const char* bytes) {
+    unsigned int value = static_cast<unsigned char>(bytes[3]);
+    value <<= 8;
+    value += static_cast<unsigned char>(bytes[2]);
+    value <<= 8;
+    value += static_cast<unsigned char>(bytes[1]);
+    value <<= 8;
+    value += static_cast<unsigned char>(bytes[0]);
+    return value;
+}
+
+static unsigned int readSectionUint(const char* name, const ElfObject& elf, unsigned int defVal) {
+    sectionView theBytes;
+    int ret = readSectionByName(name, elf, theBytes);
     if (ret) {
         ALOGV("Couldn't find section %s (defaulting to %u [0x%x]).", name, defVal, defVal);
         return defVal;
@@ -228,75 +507,68 @@ unsigned int readSectionUint(const char* name, ifstream& elfFile, unsigned int d
         ALOGE("Section %s too short (defaulting to %u [0x%x]).", name, defVal, defVal);
         return defVal;
     } else {
-        // decode first 4 bytes as LE32 uint, there will likely be more bytes due to alignment.
-        unsigned int value = static_cast<unsigned char>(theBytes[3]);
-        value <<= 8;
-        value += static_cast<unsigned char>(theBytes[2]);
-        value <<= 8;
-        value += static_cast<unsigned char>(theBytes[1]);
-        value <<= 8;
-        value += static_cast<unsigned char>(theBytes[0]);
+        unsigned int value = decodeLe32(theBytes.data());
         ALOGV("Section %s value is %u [0x%x]", name, value, value);
         return value;
     }
 }
 
-static int readSectionByType(ifstream& elfFile, int type, vector<char>& data) {
-    int ret;
-    vector<Elf64_Shdr> shTable;
-
-    ret = readSectionHeadersAll(elfFile, shTable);
-    if (ret) return ret;
-
-    for (int i = 0; i < (int)shTable.size(); i++) {
-        if ((int)shTable[i].sh_type != type) continue;
-
-        vector<char> dataTmp;
-        dataTmp.resize(shTable[i].sh_size);
-
-        elfFile.seekg(shTable[i].sh_offset);
-        if (elfFile.fail()) return -1;
-
-        if (!elfFile.read((char*)dataTmp.data(), shTable[i].sh_size)) return -1;
+/*
+ * Read just an object's bpfloader_{min,max}_ver, without mapping or indexing it: this takes
+ * the ELF header, the section header table, the section names and the two values.
+ */
+static int readObjectVersions(const string& elfPath, unsigned int& minVer,
+                              unsigned int& maxVer) {
+    unique_fd fd(open(elfPath.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd.ok()) return -errno;
 
-        data = dataTmp;
-        return 0;
+    Elf64_Ehdr eh;
+    if (pread(fd, &eh, sizeof(eh), 0) != sizeof(eh) || eh.e_shentsize != sizeof(Elf64_Shdr) ||
+        eh.e_shstrndx >= eh.e_shnum) {
+        return -EINVAL;
     }
-    return -2;
-}
 
-static bool symCompare(Elf64_Sym a, Elf64_Sym b) {
-    return (a.st_value < b.st_value);
-}
-
-static int readSymTab(ifstream& elfFile, int sort, vector<Elf64_Sym>& data) {
-    int ret, numElems;
-    Elf64_Sym* buf;
-    vector<char> secData;
-
-    ret = readSectionByType(elfFile, SHT_SYMTAB, secData);
-    if (ret) return ret;
-
-    buf = (Elf64_Sym*)secData.data();
-    numElems = (secData.size() / sizeof(Elf64_Sym));
-    data.assign(buf, buf + numElems);
-
-    if (sort) std::sort(data.begin(), data.end(), symCompare);
+    vector<Elf64_Shdr> shTable(eh.e_shnum);
+    ssize_t len = shTable.size() * sizeof(Elf64_Shdr);
+    if (pread(fd, shTable.data(), len, eh.e_shoff) != len) return -EINVAL;
+
+    const Elf64_Shdr& strtab = shTable[eh.e_shstrndx];
+    if (strtab.sh_size > (1 << 20)) return -EINVAL;
+    string names(strtab.sh_size, '\0');
+    len = names.size();
+    if (pread(fd, names.data(), len, strtab.sh_offset) != len) return -EINVAL;
+
+    minVer = DEFAULT_BPFLOADER_MIN_VER;
+    maxVer = DEFAULT_BPFLOADER_MAX_VER;
+    for (const auto& sh : shTable) {
+        if (sh.sh_name >= names.size() || sh.sh_size < sizeof(unsigned int)) continue;
+
+        unsigned int* value = nullptr;
+        if (!strcmp(names.c_str() + sh.sh_name, "bpfloader_min_ver")) value = &minVer;
+        if (!strcmp(names.c_str() + sh.sh_name, "bpfloader_max_ver")) value = &maxVer;
+        if (!value) continue;
+
+        char bytes[sizeof(unsigned int)];
+        if (pread(fd, bytes, sizeof(bytes), sh.sh_offset) != sizeof(bytes)) return -EINVAL;
+        *value = decodeLe32(bytes);
+    }
     return 0;
 }
 
-static enum bpf_prog_type getFuseProgType() {
-    int result = BPF_PROG_TYPE_UNSPEC;
-    ifstream("/sys/fs/fuse/bpf_prog_type_fuse") >> result;
-    return static_cast<bpf_prog_type>(result);
+unsigned int readSectionUint(const char* name, ifstream& elfFile, unsigned int defVal) {
+    ElfObject elf;
+    if (readElfObject(elfFile, elf)) {
+        ALOGE("Couldn't parse ELF object (defaulting %s to %u [0x%x]).", name, defVal, defVal);
+        return defVal;
+    }
+    return readSectionUint(name, elf, defVal);
 }
 
 static enum bpf_prog_type getSectionType(string& name) {
     for (auto& snt : sectionNameTypes)
         if (StartsWith(name, snt.name)) return snt.type;
 
-    // TODO Remove this code when fuse-bpf is upstream and this BPF_PROG_TYPE_FUSE is fixed
-    if (StartsWith(name, "fuse/")) return getFuseProgType();
+    if (StartsWith(name, "fuse/")) return getKernelProbe().fuseProgType();
 
     return BPF_PROG_TYPE_UNSPEC;
 }
@@ -316,9 +588,9 @@ static string getSectionName(enum bpf_prog_type type)
     return "UNKNOWN SECTION NAME " + std::to_string(type);
 }
 
-static int readProgDefs(ifstream& elfFile, vector<struct bpf_prog_def>& pd) {
-    vector<char> pdData;
-    int ret = readSectionByName("progs", elfFile, pdData);
+static int readProgDefs(const ElfObject& elf, vector<struct bpf_prog_def>& pd) {
+    sectionView pdData;
+    int ret = readSectionByName("progs", elf, pdData);
     if (ret) return ret;
 
     if (pdData.size() % sizeof(struct bpf_prog_def)) {
@@ -332,30 +604,9 @@ static int readProgDefs(ifstream& elfFile, vector<struct bpf_prog_def>& pd) {
     return 0;
 }
 
-static int getSectionSymNames(ifstream& elfFile, const string& sectionName, vector<string>& names,
-                              optional<unsigned> symbolType = std::nullopt) {
-    int ret;
-    string name;
-    vector<Elf64_Sym> symtab;
-    vector<Elf64_Shdr> shTable;
-
-    ret = readSymTab(elfFile, 1 /* sort */, symtab);
-    if (ret) return ret;
-
-    /* Get index of section */
-    ret = readSectionHeadersAll(elfFile, shTable);
-    if (ret) return ret;
-
-    int sec_idx = -1;
-    for (int i = 0; i < (int)shTable.size(); i++) {
-        ret = getSymName(elfFile, shTable[i].sh_name, name);
-        if (ret) return ret;
-
-        if (!name.compare(sectionName)) {
-            sec_idx = i;
-            break;
-        }
-    }
+int getSectionSymNames(const ElfObject& elf, const string& sectionName, vector<string>& names,
+                       optional<unsigned> symbolType) {
+    int sec_idx = getSectionIdx(elf, sectionName);
 
     /* No section found with matching name*/
     if (sec_idx == -1) {
@@ -363,15 +614,14 @@ static int getSectionSymNames(ifstream& elfFile, const string& sectionName, vect
         return -1;
     }
 
-    for (int i = 0; i < (int)symtab.size(); i++) {
-        if (symbolType.has_value() && ELF_ST_TYPE(symtab[i].st_info) != symbolType) continue;
+    for (int symIdx : elf.sectionSyms[sec_idx]) {
+        const Elf64_Sym& sym = elf.symtab[symIdx];
+        if (symbolType.has_value() && ELF_ST_TYPE(sym.st_info) != symbolType) continue;
 
-        if (symtab[i].st_shndx == sec_idx) {
-            string s;
-            ret = getSymName(elfFile, symtab[i].st_name, s);
-            if (ret) return ret;
-            names.push_back(s);
-        }
+        string s;
+        int ret = getSymName(elf, sym.st_name, s);
+        if (ret) return ret;
+        names.push_back(s);
     }
 
     return 0;
@@ -382,7 +632,7 @@ static bool IsAllowed(bpf_prog_type type, const bpf_prog_type* allowed, size_t n
 
     for (size_t i = 0; i < numAllowed; i++) {
         if (allowed[i] == BPF_PROG_TYPE_UNSPEC) {
-            if (type == getFuseProgType()) return true;
+            if (type == getKernelProbe().fuseProgType()) return true;
         } else if (type == allowed[i])
             return true;
     }
@@ -390,58 +640,88 @@ static bool IsAllowed(bpf_prog_type type, const bpf_prog_type* allowed, size_t n
     return false;
 }
 
-/* Read a section by its index - for ex to get sec hdr strtab blob */
-static int readCodeSections(ifstream& elfFile, vector<codeSection>& cs,
-                            const bpf_prog_type* allowed, size_t numAllowed) {
-    vector<Elf64_Shdr> shTable;
+/*
+ * Set up a code section's type, expected attach type and name from its ELF section name.
+ * Leaves the type BPF_PROG_TYPE_UNSPEC for sections which aren't programs.
+ */
+int initCodeSection(const string& sectionName, codeSection& cs, const bpf_prog_type* allowed,
+                    size_t numAllowed) {
+    string name = sectionName;
+    enum bpf_prog_type ptype = getSectionType(name);
+
+    cs.type = BPF_PROG_TYPE_UNSPEC;
+    if (ptype == BPF_PROG_TYPE_UNSPEC) return 0;
+
+    if (!IsAllowed(ptype, allowed, numAllowed)) {
+        ALOGE("Program type %s not permitted here", getSectionName(ptype).c_str());
+        return -1;
+    }
+
+    // This must be done before '/' is replaced with '_'.
+    cs.expected_attach_type = getExpectedAttachType(name);
+
+    // convert all slashes to underscores
+    std::replace(name.begin(), name.end(), '/', '_');
+
+    cs.type = ptype;
+    cs.name = name;
+    return 0;
+}
+
+vector<size_t> selectProgVariants(const vector<codeSection>& cs) {
+    std::unordered_map<string, size_t> required;  // program name without $ suffix -> index
+    vector<size_t> keep;
+
+    for (size_t i = 0; i < cs.size(); i++) {
+        string name = cs[i].name.substr(0, cs[i].name.find_last_of('$'));
+        auto it = required.find(name);
+        if (it != required.end()) {
+            ALOGD("skipping program %s, variant %s applies", cs[i].name.c_str(),
+                  cs[it->second].name.c_str());
+            continue;
+        }
+        if (!cs[i].prog_def || !cs[i].prog_def->optional) required.emplace(name, i);
+        keep.push_back(i);
+    }
+    return keep;
+}
+
+/*
+ * Read all code sections, together with their relocation sections and program definitions.
+ * With env, programs whose definitions exclude them are pruned, as are the variants of a program
+ * selectProgVariants() says are never tried, from the section headers and definitions alone: the
+ * code and relocations of the programs which won't be loaded are never read.
+ */
+int readCodeSections(const ElfObject& elf, vector<codeSection>& cs,
+                     const bpf_prog_type* allowed, size_t numAllowed, const loadEnv* env) {
     int entries, ret = 0;
 
-    ret = readSectionHeadersAll(elfFile, shTable);
-    if (ret) return ret;
-    entries = shTable.size();
+    entries = elf.shnum;
 
     vector<struct bpf_prog_def> pd;
-    ret = readProgDefs(elfFile, pd);
+    ret = readProgDefs(elf, pd);
     if (ret) return ret;
     vector<string> progDefNames;
-    ret = getSectionSymNames(elfFile, "progs", progDefNames);
+    ret = getSectionSymNames(elf, "progs", progDefNames);
     if (!pd.empty() && ret) return ret;
 
+    vector<codeSection> found;
+    vector<int> foundIdx;  // section index of each found code section
     for (int i = 0; i < entries; i++) {
         string name;
         codeSection cs_temp;
         cs_temp.type = BPF_PROG_TYPE_UNSPEC;
 
-        ret = getSymName(elfFile, shTable[i].sh_name, name);
+        ret = getSectionNameByIdx(elf, i, name);
         if (ret) return ret;
 
-        enum bpf_prog_type ptype = getSectionType(name);
-
-        if (ptype == BPF_PROG_TYPE_UNSPEC) continue;
-
-        if (!IsAllowed(ptype, allowed, numAllowed)) {
-            ALOGE("Program type %s not permitted here", getSectionName(ptype).c_str());
-            return -1;
-        }
-
-        // This must be done before '/' is replaced with '_'.
-        cs_temp.expected_attach_type = getExpectedAttachType(name);
-
-        string oldName = name;
-
-        // convert all slashes to underscores
-        std::replace(name.begin(), name.end(), '/', '_');
-
-        cs_temp.type = ptype;
-        cs_temp.name = name;
-
-        ret = readSectionByIdx(elfFile, i, cs_temp.data);
+        ret = initCodeSection(name, cs_temp, allowed, numAllowed);
         if (ret) return ret;
-        ALOGV("Loaded code section %d (%s)", i, name.c_str());
+        if (cs_temp.type == BPF_PROG_TYPE_UNSPEC) continue;
 
         vector<string> csSymNames;
-        ret = getSectionSymNames(elfFile, oldName, csSymNames, STT_FUNC);
-        if (ret || !csSymNames.size()) return ret;
+        ret = getSectionSymNames(elf, name, csSymNames, STT_FUNC);
+        if (ret || !csSymNames.size()) break;
         for (size_t i = 0; i < progDefNames.size(); ++i) {
             if (!progDefNames[i].compare(csSymNames[0] + "_def")) {
                 cs_temp.prog_def = pd[i];
@@ -449,13 +729,43 @@ static int readCodeSections(ifstream& elfFile, vector<codeSection>& cs,
             }
         }
 
+        if (env && cs_temp.prog_def) {
+            if (const char* why = excludedBy(*cs_temp.prog_def, *env)) {
+                ALOGD("skipping program %s, excluded by %s", cs_temp.name.c_str(), why);
+                continue;
+            }
+        }
+        found.push_back(std::move(cs_temp));
+        foundIdx.push_back(i);
+    }
+    if (ret) return ret;
+
+    vector<size_t> keep;
+    if (env) {
+        keep = selectProgVariants(found);
+    } else {
+        for (size_t k = 0; k < found.size(); k++) keep.push_back(k);
+    }
+
+    for (size_t k : keep) {
+        codeSection& cs_temp = found[k];
+        int i = foundIdx[k];
+        string oldName, name;
+
+        ret = getSectionNameByIdx(elf, i, oldName);
+        if (ret) return ret;
+
+        ret = readSectionByIdx(elf, i, cs_temp.data);
+        if (ret) return ret;
+        ALOGV("Loaded code section %d (%s)", i, cs_temp.name.c_str());
+
         /* Check for rel section */
-        if (cs_temp.data.size() > 0 && i < entries) {
-            ret = getSymName(elfFile, shTable[i + 1].sh_name, name);
+        if (cs_temp.data.size() > 0 && i + 1 < entries) {
+            ret = getSectionNameByIdx(elf, i + 1, name);
             if (ret) return ret;
 
             if (name == (".rel" + oldName)) {
-                ret = readSectionByIdx(elfFile, i + 1, cs_temp.rel_data);
+                ret = readSectionByIdx(elf, i + 1, cs_temp.rel_data);
                 if (ret) return ret;
                 ALOGV("Loaded relo section %d (%s)", i, name.c_str());
             }
@@ -469,29 +779,15 @@ static int readCodeSections(ifstream& elfFile, vector<codeSection>& cs,
     return 0;
 }
 
-static int getSymNameByIdx(ifstream& elfFile, int index, string& name) {
-    vector<Elf64_Sym> symtab;
-    int ret = 0;
-
-    ret = readSymTab(elfFile, 0 /* !sort */, symtab);
-    if (ret) return ret;
-
-    if (index >= (int)symtab.size()) return -1;
-
-    return getSymName(elfFile, symtab[index].st_name, name);
-}
-
-static bool mapMatchesExpectations(const unique_fd& fd, const string& mapName,
-                                   const struct bpf_map_def& mapDef, const enum bpf_map_type type) {
-    // Assuming fd is a valid Bpf Map file descriptor then
-    // all the following should always succeed on a 4.14+ kernel.
-    // If they somehow do fail, they'll return -1 (and set errno),
-    // which should then cause (among others) a key_size mismatch.
-    int fd_type = bpfGetFdMapType(fd);
-    int fd_key_size = bpfGetFdKeySize(fd);
-    int fd_value_size = bpfGetFdValueSize(fd);
-    int fd_max_entries = bpfGetFdMaxEntries(fd);
-    int fd_map_flags = bpfGetFdMapFlags(fd);
+/* Whether the map described by info is what mapDef asks for, logs a mismatch unless quiet */
+static bool mapInfoMatches(const struct bpf_map_info& info, const string& mapName,
+                           const struct bpf_map_def& mapDef, const enum bpf_map_type type,
+                           bool quiet = false) {
+    int fd_type = (int)info.type;
+    int fd_key_size = (int)info.key_size;
+    int fd_value_size = (int)info.value_size;
+    int fd_max_entries = (int)info.max_entries;
+    int fd_map_flags = (int)info.map_flags;
 
     // DEVMAPs are readonly from the bpf program side's point of view, as such
     // the kernel in kernel/bpf/devmap.c dev_map_init_map() will set the flag
@@ -521,6 +817,7 @@ static bool mapMatchesExpectations(const unique_fd& fd, const string& mapName,
         (fd_map_flags == desired_map_flags)) {
         return true;
     }
+    if (quiet) return false;
 
     ALOGE("bpf map name %s mismatch: desired/found: "
           "type:%d/%d key:%u/%d value:%u/%d entries:%u/%d flags:%u/%d",
@@ -529,16 +826,12 @@ static bool mapMatchesExpectations(const unique_fd& fd, const string& mapName,
     return false;
 }
 
-static int createMaps(const char* elfPath, ifstream& elfFile, vector<unique_fd>& mapFds,
-                      const char* prefix) {
+/* Read the map definitions and their names, returns -2 if the object has no maps */
+int readMapDefs(const ElfObject& elf, vector<struct bpf_map_def>& md, vector<string>& mapNames) {
     int ret;
-    vector<char> mdData;
-    vector<struct bpf_map_def> md;
-    vector<string> mapNames;
-    string objName = pathToObjName(string(elfPath));
+    sectionView mdData;
 
-    ret = readSectionByName("maps", elfFile, mdData);
-    if (ret == -2) return 0;  // no maps to read
+    ret = readSectionByName("maps", elf, mdData);
     if (ret) return ret;
 
     if (mdData.size() % sizeof(struct bpf_map_def)) {
@@ -549,98 +842,487 @@ static int createMaps(const char* elfPath, ifstream& elfFile, vector<unique_fd>&
     md.resize(mdData.size() / sizeof(struct bpf_map_def));
     memcpy(md.data(), mdData.data(), mdData.size());
 
-    ret = getSectionSymNames(elfFile, "maps", mapNames);
+    ret = getSectionSymNames(elf, "maps", mapNames);
     if (ret) return ret;
 
-    unsigned kvers = kernelVersion();
+    if (mapNames.size() > md.size()) {
+        ALOGE("more map symbols than map definitions, %zu > %zu", mapNames.size(), md.size());
+        return -1;
+    }
+    return 0;
+}
 
-    for (int i = 0; i < (int)mapNames.size(); i++) {
-        if (md[i].zero != 0) abort();
+/* Read the object's map_scaling section, if it has one, see bpf_map_scaling.h */
+int readMapScaling(const ElfObject& elf, vector<struct bpf_map_scaling>& scaling) {
+    sectionView data;
 
-        if (kvers < md[i].min_kver) {
-            ALOGD("skipping map %s which requires kernel version 0x%x >= 0x%x",
-                  mapNames[i].c_str(), kvers, md[i].min_kver);
-            mapFds.push_back(unique_fd());
-            continue;
-        }
+    scaling.clear();
+    if (readSectionByName("map_scaling", elf, data)) return 0;
 
-        if (kvers >= md[i].max_kver) {
-            ALOGD("skipping map %s which requires kernel version 0x%x < 0x%x",
-                  mapNames[i].c_str(), kvers, md[i].max_kver);
-            mapFds.push_back(unique_fd());
-            continue;
-        }
+    if (data.size() % sizeof(struct bpf_map_scaling)) {
+        ALOGE("improper sized map_scaling section, %zu %% %zu != 0", data.size(),
+              sizeof(struct bpf_map_scaling));
+        return -1;
+    }
+    scaling.resize(data.size() / sizeof(struct bpf_map_scaling));
+    memcpy(scaling.data(), data.data(), data.size());
+    for (auto& s : scaling) s.map_name[sizeof(s.map_name) - 1] = '\0';
+    return 0;
+}
 
-        enum bpf_map_type type = md[i].type;
-        if (type == BPF_MAP_TYPE_DEVMAP_HASH && !isAtLeastKernelVersion(5, 4, 0)) {
-            // On Linux Kernels older than 5.4 this map type doesn't exist, but it can kind
-            // of be approximated: HASH has the same userspace visible api.
-            // However it cannot be used by ebpf programs in the same way.
-            // Since bpf_redirect_map() only requires 4.14, a program using a DEVMAP_HASH map
-            // would fail to load (due to trying to redirect to a HASH instead of DEVMAP_HASH).
-            // One must thus tag any BPF_MAP_TYPE_DEVMAP_HASH + bpf_redirect_map() using
-            // programs as being 5.4+...
-            type = BPF_MAP_TYPE_HASH;
-        }
+// Format of pin location is /sys/fs/bpf/<prefix>map_<objName>_<mapName>
+// except that maps shared across .o's have empty <objName>
+// Note: <objName> refers to the extension-less basename of the .o file (without @ suffix).
+static string getMapPinLoc(const char* prefix, const string& objName,
+                           const struct bpf_map_def& md, const string& mapName) {
+    return string(BPF_FS_PATH) + prefix + "map_" + (md.shared ? "" : objName) + "_" + mapName;
+}
 
-        // The .h file enforces that this is a power of two, and page size will
-        // also always be a power of two, so this logic is actually enough to
-        // force it to be a multiple of the page size, as required by the kernel.
-        unsigned int max_entries = md[i].max_entries;
-        if (type == BPF_MAP_TYPE_RINGBUF) {
-            if (max_entries < page_size) max_entries = page_size;
-        }
+// Format of pin location is /sys/fs/bpf/<prefix>prog_<objName>_<progName>
+// where <progName> is the code section name without any $foo suffix, which can be used to
+// provide duplicate programs conditionally loaded based on running kernel version.
+static string getProgPinLoc(const char* prefix, const string& objName, const string& csName) {
+    return string(BPF_FS_PATH) + prefix + "prog_" + objName + '_' +
+           csName.substr(0, csName.find_last_of('$'));
+}
 
-        // Format of pin location is /sys/fs/bpf/<prefix>map_<objName>_<mapName>
-        // except that maps shared across .o's have empty <objName>
-        // Note: <objName> refers to the extension-less basename of the .o file (without @ suffix).
-        string mapPinLoc = string(BPF_FS_PATH) + prefix + "map_" +
-                           (md[i].shared ? "" : objName) + "_" + mapNames[i];
-        bool reuse = false;
-        unique_fd fd;
-        int saved_errno;
+/* Set the map_name or prog_name of a bpf_attr, truncated as the kernel only keeps so much */
+static void setObjName(char (&dst)[BPF_OBJ_NAME_LEN], const string& name) {
+#ifdef __BIONIC__
+    strlcpy(dst, name.c_str(), sizeof(dst));
+#else
+    // Host builds, glibc only has strlcpy from 2.38 on
+    strncpy(dst, name.c_str(), sizeof(dst) - 1);
+    dst[sizeof(dst) - 1] = '\0';
+#endif
+}
 
-        if (access(mapPinLoc.c_str(), F_OK) == 0) {
-            fd.reset(mapRetrieveRO(mapPinLoc.c_str()));
-            saved_errno = errno;
-            ALOGV("bpf_create_map reusing map %s, ret: %d", mapNames[i].c_str(), fd.get());
-            reuse = true;
-        } else {
-            union bpf_attr req = {
-              .map_type = type,
-              .key_size = md[i].key_size,
-              .value_size = md[i].value_size,
-              .max_entries = max_entries,
-              .map_flags = md[i].map_flags,
-            };
-            strlcpy(req.map_name, mapNames[i].c_str(), sizeof(req.map_name));
-            fd.reset(bpf(BPF_MAP_CREATE, req));
-            saved_errno = errno;
-            ALOGV("bpf_create_map name %s, ret: %d", mapNames[i].c_str(), fd.get());
-        }
+static int createMap(const string& mapName, const struct bpf_map_def& md,
+                     enum bpf_map_type type, unsigned int max_entries) {
+    union bpf_attr req = {
+      .map_type = type,
+      .key_size = md.key_size,
+      .value_size = md.value_size,
+      .max_entries = max_entries,
+      .map_flags = md.map_flags,
+    };
+    setObjName(req.map_name, mapName);
+    return getBpfBackend().bpf(BPF_MAP_CREATE, req);
+}
 
-        if (!fd.ok()) return -saved_errno;
+static std::atomic<bool> sMapMigration = false;
 
-        // When reusing a pinned map, we need to check the map type/sizes/etc match, but for
-        // safety (since reuse code path is rare) run these checks even if we just created it.
-        // We assume failure is due to pinned map mismatch, hence the 'NOT UNIQUE' return code.
-        if (!mapMatchesExpectations(fd, mapNames[i], md[i], type)) return -ENOTUNIQ;
+/*
+ * The pin paths of the maps migrated since the current load began: programs pinned before that
+ * may still use the replaced maps. Cleared when the load is done.
+ */
+static std::mutex sMigratedMutex;
+static std::set<string> sMigratedMaps;
 
-        if (!reuse) {
-            ret = bpfFdPin(fd, mapPinLoc.c_str());
-            if (ret) {
-                int err = errno;
-                ALOGE("pin %s -> %d [%d:%s]", mapPinLoc.c_str(), ret, err, strerror(err));
-                return -err;
-            }
-            ret = chmod(mapPinLoc.c_str(), md[i].mode);
-            if (ret) {
-                int err = errno;
-                ALOGE("chmod(%s, 0%o) = %d [%d:%s]", mapPinLoc.c_str(), md[i].mode, ret, err,
-                      strerror(err));
-                return -err;
-            }
-            ret = chown(mapPinLoc.c_str(), (uid_t)md[i].uid, (gid_t)md[i].gid);
+static bool mapsMigrated() {
+    std::lock_guard<std::mutex> lock(sMigratedMutex);
+    return !sMigratedMaps.empty();
+}
+
+static std::set<string> migratedMaps() {
+    std::lock_guard<std::mutex> lock(sMigratedMutex);
+    return sMigratedMaps;
+}
+
+static void clearMigratedMaps() {
+    std::lock_guard<std::mutex> lock(sMigratedMutex);
+    sMigratedMaps.clear();
+}
+
+void setMapMigration(bool enable) {
+    sMapMigration = enable;
+}
+
+static bool isPerCpuMap(enum bpf_map_type type) {
+    return type == BPF_MAP_TYPE_PERCPU_HASH || type == BPF_MAP_TYPE_PERCPU_ARRAY ||
+           type == BPF_MAP_TYPE_LRU_PERCPU_HASH;
+}
+
+/* Maps whose entries are plain data, which can thus be copied to a new map */
+static bool isMigratableMap(enum bpf_map_type type) {
+    return type == BPF_MAP_TYPE_HASH || type == BPF_MAP_TYPE_ARRAY ||
+           type == BPF_MAP_TYPE_LRU_HASH || isPerCpuMap(type);
+}
+
+static int getNumPossibleCpus() {
+    string possible;
+    int first, last;
+
+    // ie. "0-7"
+    if (!android::base::ReadFileToString("/sys/devices/system/cpu/possible", &possible) ||
+        sscanf(possible.c_str(), "%d-%d", &first, &last) != 2) {
+        return sysconf(_SC_NPROCESSORS_CONF);
+    }
+    return last + 1;
+}
+
+static int64_t roundUpPow2(int64_t n) {
+    int64_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+/*
+ * Estimate the kernel memory of a map, roughly following the kernel's allocations: hash maps
+ * preallocate all their elements (a 48 byte header, the key and value) unless created with
+ * BPF_F_NO_PREALLOC, in which case only the buckets are up front.  Per-CPU values exist once
+ * per possible cpu.  Excludes the fixed size struct bpf_map.
+ */
+static int64_t estimateMapBytes(enum bpf_map_type type, const struct bpf_map_def& md,
+                                unsigned int max_entries) {
+    static const int cpus = getNumPossibleCpus();
+    const int64_t n = max_entries;
+    const int64_t key = (md.key_size + 7) & ~7;
+    const int64_t value = (md.value_size + 7) & ~7;
+
+    switch (type) {
+        case BPF_MAP_TYPE_ARRAY:
+            return n * value;
+        case BPF_MAP_TYPE_PERCPU_ARRAY:
+            return n * (8 + value * cpus);
+        case BPF_MAP_TYPE_HASH:
+        case BPF_MAP_TYPE_LRU_HASH:
+        case BPF_MAP_TYPE_PERCPU_HASH:
+        case BPF_MAP_TYPE_LRU_PERCPU_HASH: {
+            int64_t buckets = roundUpPow2(n) * 16;
+            if (md.map_flags & BPF_F_NO_PREALLOC) return buckets;
+            if (isPerCpuMap(type)) return buckets + n * (48 + key + 8 + value * cpus);
+            return buckets + n * (48 + key + value);
+        }
+        case BPF_MAP_TYPE_RINGBUF:
+            return n;
+        case BPF_MAP_TYPE_PROG_ARRAY:
+        case BPF_MAP_TYPE_DEVMAP:
+        case BPF_MAP_TYPE_DEVMAP_HASH:
+            return n * 8;
+        default:
+            return n * (key + value);
+    }
+}
+
+static std::atomic<int64_t> sMemoryBudget = 0;
+static std::atomic<int64_t> sMemoryUsed = 0;
+
+void setMemoryBudget(int64_t bytes) {
+    sMemoryBudget = bytes;
+    sMemoryUsed = 0;
+}
+
+/* Account for bytes of kernel objects about to be created, false if that exceeds the budget */
+static bool chargeMemory(int64_t bytes) {
+    int64_t used = sMemoryUsed.load();
+    do {
+        int64_t budget = sMemoryBudget;
+        if (budget && used + bytes > budget) {
+            ALOGE("%" PRId64 " bytes exceed the bpf memory budget: %" PRId64 " of %" PRId64
+                  " bytes used", bytes, used, budget);
+            return false;
+        }
+    } while (!sMemoryUsed.compare_exchange_weak(used, used + bytes));
+    return true;
+}
+
+/*
+ * Return what chargeMemory() accounted for an object which then couldn't be created, or the
+ * difference from an estimate (negative when the estimate was short)
+ */
+static void refundMemory(int64_t bytes) {
+    sMemoryUsed -= bytes;
+}
+
+/*
+ * Copy all entries of map 'from' to map 'to', whose entries have the same size, in batches
+ * where the kernel supports that (5.6+) or one by one otherwise.
+ */
+static int copyMapEntries(const unique_fd& from, const unique_fd& to, size_t keySize,
+                          size_t valueSize) {
+    const int ENOTSUPP = 524;  // kernel internal, for map types without batch operations
+    __u32 batchSize = 256;
+    vector<char> keys, values;
+    uint64_t inBatch = 0, outBatch = 0;  // an opaque position, a bucket or index
+    bool first = true;
+
+    while (true) {
+        keys.resize(keySize * batchSize);
+        values.resize(valueSize * batchSize);
+        union bpf_attr lookup = {
+          .batch = {
+            .in_batch = first ? 0 : ptr_to_u64(&inBatch),
+            .out_batch = ptr_to_u64(&outBatch),
+            .keys = ptr_to_u64(keys.data()),
+            .values = ptr_to_u64(values.data()),
+            .count = batchSize,
+            .map_fd = static_cast<__u32>(from.get()),
+          },
+        };
+        int err = getBpfBackend().bpf(BPF_MAP_LOOKUP_BATCH, lookup) ? errno : 0;
+        bool last = err == ENOENT;  // and lookup.batch.count are the last entries
+        if (err == ENOSPC && batchSize < (1u << 16)) {
+            batchSize *= 2;  // a hash bucket has more entries than a batch holds
+            continue;
+        }
+        if (err && !last) {
+            // EINVAL is the command unknown to kernels before 5.6
+            if (first && (err == EINVAL || err == ENOTSUPP)) break;
+            return -err;
+        }
+        first = false;
+
+        if (lookup.batch.count) {
+            union bpf_attr update = {
+              .batch = {
+                .keys = ptr_to_u64(keys.data()),
+                .values = ptr_to_u64(values.data()),
+                .count = lookup.batch.count,
+                .map_fd = static_cast<__u32>(to.get()),
+              },
+            };
+            if (getBpfBackend().bpf(BPF_MAP_UPDATE_BATCH, update)) return -errno;
+        }
+        if (last) return 0;
+        inBatch = outBatch;
+    }
+
+    vector<char> key(keySize), nextKey(keySize), value(valueSize);
+    bool haveKey = false;
+    while (true) {
+        union bpf_attr next = {
+          .map_fd = static_cast<__u32>(from.get()),
+          .key = haveKey ? ptr_to_u64(key.data()) : 0,
+          .next_key = ptr_to_u64(nextKey.data()),
+        };
+        if (getBpfBackend().bpf(BPF_MAP_GET_NEXT_KEY, next)) return errno == ENOENT ? 0 : -errno;
+        key.swap(nextKey);
+        haveKey = true;
+
+        union bpf_attr lookup = {
+          .map_fd = static_cast<__u32>(from.get()),
+          .key = ptr_to_u64(key.data()),
+          .value = ptr_to_u64(value.data()),
+        };
+        if (getBpfBackend().bpf(BPF_MAP_LOOKUP_ELEM, lookup)) {
+            if (errno == ENOENT) continue;  // deleted meanwhile
+            return -errno;
+        }
+        union bpf_attr update = {
+          .map_fd = static_cast<__u32>(to.get()),
+          .key = ptr_to_u64(key.data()),
+          .value = ptr_to_u64(value.data()),
+        };
+        if (getBpfBackend().bpf(BPF_MAP_UPDATE_ELEM, update)) return -errno;
+    }
+}
+
+/*
+ * Replace the pinned map in fd, which doesn't match its definition, with a new one copying its
+ * entries (see setMapMigration). Only maps of plain data with the same type, key and value
+ * size can be migrated: ie. max_entries or flags may change. The new map is pinned at a
+ * temporary path and renamed over the old pin, so the pin path always refers to one of them.
+ * Entries written to the old map while copying are lost. info is that of the pinned map, on
+ * success fd is the new map.
+ */
+static int migrateMap(unique_fd& fd, const struct bpf_map_info& info, const string& mapPinLoc,
+                      const string& mapName, const struct bpf_map_def& md,
+                      enum bpf_map_type type, unsigned int max_entries) {
+    if (!isMigratableMap(type) || info.type != type || info.key_size != md.key_size ||
+        info.value_size != md.value_size) {
+        ALOGE("bpf map %s can't be migrated", mapName.c_str());
+        return -ENOTUNIQ;
+    }
+
+    unique_fd newFd(createMap(mapName, md, type, max_entries));
+    if (!newFd.ok()) {
+        int err = errno;
+        ALOGE("bpf map %s: creating migration target failed [%d:%s]", mapName.c_str(), err,
+              strerror(err));
+        return -err;
+    }
+
+    // Per-CPU maps get and set one value per possible cpu, each padded to 8 bytes
+    size_t valueSize = md.value_size;
+    if (isPerCpuMap(type)) valueSize = ((valueSize + 7) & ~7) * getNumPossibleCpus();
+    int ret = copyMapEntries(fd, newFd, md.key_size, valueSize);
+    if (ret) {
+        ALOGE("bpf map %s: copying entries failed [%d:%s]", mapName.c_str(), -ret,
+              strerror(-ret));
+        return ret;
+    }
+
+    BpfBackend& backend = getBpfBackend();
+    string tmpPinLoc = mapPinLoc + "_migrating";  // bpffs reserves names with dots
+    backend.unlink(tmpPinLoc.c_str());  // left over by an interrupted migration
+    if (pinObject(newFd, tmpPinLoc.c_str()) || backend.chmod(tmpPinLoc.c_str(), md.mode) ||
+        backend.chown(tmpPinLoc.c_str(), (uid_t)md.uid, (gid_t)md.gid) ||
+        backend.rename(tmpPinLoc.c_str(), mapPinLoc.c_str())) {
+        int err = errno;
+        ALOGE("bpf map %s: re-pinning failed [%d:%s]", mapName.c_str(), err, strerror(err));
+        backend.unlink(tmpPinLoc.c_str());
+        return -err;
+    }
+
+    ALOGI("bpf map %s migrated to max_entries %u flags 0x%x", mapPinLoc.c_str(), max_entries,
+          md.map_flags);
+    fd = std::move(newFd);
+    std::lock_guard<std::mutex> lock(sMigratedMutex);
+    sMigratedMaps.insert(mapPinLoc);
+    return 0;
+}
+
+/*
+ * The maps created or validated by this process, by pin path, with their info as of then. Later
+ * objects referring to the same (ie. shared) map take it from here, instead of looking the pin
+ * up in bpffs and asking the kernel about the map again. The pins are only this process' to
+ * change while it loads, so this is cleared at the end of every loadProg()/loadProgs() call.
+ */
+class mapRegistry {
+  public:
+    /* A new fd of the map pinned at path and its info, -1 if there is no such map */
+    int get(const string& path, struct bpf_map_info& info) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mMaps.find(path);
+        if (it == mMaps.end()) return -1;
+        info = it->second.info;
+        return getBpfBackend().dup(it->second.fd.get());
+    }
+
+    void put(const string& path, const unique_fd& fd, const struct bpf_map_info& info) {
+        unique_fd held(getBpfBackend().dup(fd.get()));
+        if (!held.ok()) return;
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mMaps[path] = {std::move(held), info};
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mMaps.clear();
+    }
+
+  private:
+    struct entry {
+        unique_fd fd;
+        struct bpf_map_info info;
+    };
+
+    std::mutex mMutex;
+    std::unordered_map<string, entry> mMaps;
+};
+
+static mapRegistry sMapRegistry;
+
+static int createMaps(const char* elfPath, const vector<struct bpf_map_def>& md,
+                      const vector<string>& mapNames, vector<unique_fd>& mapFds,
+                      std::unordered_map<int, uint32_t>& mapIds, const char* prefix,
+                      LoadTimings& timings, LoadFootprint& footprint) {
+    int ret = 0;
+    string objName = pathToObjName(string(elfPath));
+
+    if (mapNames.empty()) return 0;
+
+    kernelProbe& probe = getKernelProbe();
+    const loadEnv env = getLoadEnv();
+
+    for (int i = 0; i < (int)mapNames.size(); i++) {
+        if (md[i].zero != 0) abort();
+
+        if (const char* why = excludedBy(md[i], env)) {
+            ALOGD("skipping map %s, excluded by %s (kernel version 0x%x)", mapNames[i].c_str(),
+                  why, env.kvers);
+            mapFds.push_back(unique_fd());
+            continue;
+        }
+
+        enum bpf_map_type type = md[i].type;
+        for (const auto& f : mapTypeFallbacks) {
+            if (f.type == type && !probe.mapTypeSupported(type)) {
+                ALOGD("map %s: kernel lacks type %d, using %d", mapNames[i].c_str(), type,
+                      f.fallback);
+                type = f.fallback;
+            }
+        }
+
+        // The .h file enforces that this is a power of two, and page size will
+        // also always be a power of two, so this logic is actually enough to
+        // force it to be a multiple of the page size, as required by the kernel.
+        unsigned int max_entries = md[i].max_entries;
+        if (type == BPF_MAP_TYPE_RINGBUF) {
+            if (max_entries < page_size) max_entries = page_size;
+        }
+
+        string mapPinLoc = getMapPinLoc(prefix, objName, md[i], mapNames[i]);
+        bool reuse = false;
+        unique_fd fd;
+        struct bpf_map_info info;
+        int saved_errno;
+
+        // Already set up by an earlier object, a mismatch takes the usual path (and its errors)
+        fd.reset(sMapRegistry.get(mapPinLoc, info));
+        if (fd.ok() && mapInfoMatches(info, mapNames[i], md[i], type, true)) {
+            ALOGD("map %s id %u (registered)", mapPinLoc.c_str(), info.id);
+            mapIds[fd.get()] = info.id;
+            mapFds.push_back(std::move(fd));
+            continue;
+        }
+        fd.reset();
+
+        if (getBpfBackend().access(mapPinLoc.c_str(), F_OK) == 0) {
+            fd.reset(retrieveObjectRO(mapPinLoc.c_str()));
+            saved_errno = errno;
+            ALOGV("bpf_create_map reusing map %s, ret: %d", mapNames[i].c_str(), fd.get());
+            reuse = true;
+        } else {
+            int64_t bytes = estimateMapBytes(type, md[i], max_entries);
+            if (!chargeMemory(bytes)) {
+                ALOGE("not creating map %s of %s", mapNames[i].c_str(), elfPath);
+                return -ENOMEM;
+            }
+            fd.reset(createMap(mapNames[i], md[i], type, max_entries));
+            saved_errno = errno;
+            ALOGV("bpf_create_map name %s, ret: %d", mapNames[i].c_str(), fd.get());
+            if (fd.ok()) {
+                footprint.mapBytes += bytes;
+                footprint.maps.emplace_back(mapNames[i], bytes);
+            } else {
+                refundMemory(bytes);
+            }
+        }
+
+        if (!fd.ok()) return -saved_errno;
+
+        // When reusing a pinned map, we need to check the map type/sizes/etc match, but for
+        // safety (since reuse code path is rare) run these checks even if we just created it.
+        // We assume failure is due to pinned map mismatch, hence the 'NOT UNIQUE' return code.
+        // Getting the info should never fail on a 4.14+ kernel, if it somehow does, the zeroed
+        // info fails the checks.
+        int infoErr = getObjectInfo(fd.get(), info) ? errno : 0;
+        if (!mapInfoMatches(info, mapNames[i], md[i], type)) {
+            if (!reuse || !sMapMigration) return -ENOTUNIQ;
+            ret = migrateMap(fd, info, mapPinLoc, mapNames[i], md[i], type, max_entries);
+            if (ret) return ret;
+            infoErr = getObjectInfo(fd.get(), info) ? errno : 0;
+        }
+
+        if (!reuse) {
+            ScopedTiming pinTiming(timings.pinUs);
+            ret = pinObject(fd, mapPinLoc.c_str());
+            if (ret) {
+                int err = errno;
+                ALOGE("pin %s -> %d [%d:%s]", mapPinLoc.c_str(), ret, err, strerror(err));
+                return -err;
+            }
+            ret = getBpfBackend().chmod(mapPinLoc.c_str(), md[i].mode);
+            if (ret) {
+                int err = errno;
+                ALOGE("chmod(%s, 0%o) = %d [%d:%s]", mapPinLoc.c_str(), md[i].mode, ret, err,
+                      strerror(err));
+                return -err;
+            }
+            ret = getBpfBackend().chown(mapPinLoc.c_str(), (uid_t)md[i].uid, (gid_t)md[i].gid);
             if (ret) {
                 int err = errno;
                 ALOGE("chown(%s, %u, %u) = %d [%d:%s]", mapPinLoc.c_str(), md[i].uid, md[i].gid,
@@ -649,11 +1331,12 @@ static int createMaps(const char* elfPath, ifstream& elfFile, vector<unique_fd>&
             }
         }
 
-        int mapId = bpfGetFdMapId(fd);
-        if (mapId == -1) {
-            ALOGE("bpfGetFdMapId failed, ret: %d [%d]", mapId, errno);
+        if (infoErr) {
+            ALOGE("getObjectInfo of map %s failed [%d]", mapPinLoc.c_str(), infoErr);
         } else {
-            ALOGD("map %s id %d", mapPinLoc.c_str(), mapId);
+            ALOGD("map %s id %u", mapPinLoc.c_str(), info.id);
+            mapIds[fd.get()] = info.id;
+            sMapRegistry.put(mapPinLoc, fd, info);
         }
 
         mapFds.push_back(std::move(fd));
@@ -662,12 +1345,16 @@ static int createMaps(const char* elfPath, ifstream& elfFile, vector<unique_fd>&
     return ret;
 }
 
-static void applyRelo(void* insnsPtr, Elf64_Addr offset, int fd) {
+static void applyRelo(const sectionView& code, Elf64_Addr offset, int fd) {
     int insnIndex;
     struct bpf_insn *insn, *insns;
 
-    insns = (struct bpf_insn*)(insnsPtr);
+    insns = (struct bpf_insn*)(code.data());
 
+    if (offset >= code.size() / sizeof(struct bpf_insn) * sizeof(struct bpf_insn)) {
+        ALOGE("invalid relo offset %llu", (unsigned long long)offset);
+        return;
+    }
     insnIndex = offset / sizeof(struct bpf_insn);
     insn = &insns[insnIndex];
 
@@ -687,11 +1374,16 @@ static void applyRelo(void* insnsPtr, Elf64_Addr offset, int fd) {
     insn->src_reg = BPF_PSEUDO_MAP_FD;
 }
 
-static void applyMapRelo(ifstream& elfFile, vector<unique_fd> &mapFds, vector<codeSection>& cs) {
-    vector<string> mapNames;
+/* Resolve each code section's relocations to indices into the object's maps */
+void resolveMapRelos(const ElfObject& elf, vector<codeSection>& cs) {
+    int mapsIdx = getSectionIdx(elf, "maps");
+    if (mapsIdx == -1) return;
 
-    int ret = getSectionSymNames(elfFile, "maps", mapNames);
-    if (ret) return;
+    // Symbol index -> map index (-1 for non map symbols), built once per object.
+    // Maps follow the same st_value ordering as the symbols in the maps section.
+    vector<int> symToMap(elf.symnum, -1);
+    const vector<int>& mapSyms = elf.sectionSyms[mapsIdx];
+    for (int j = 0; j < (int)mapSyms.size(); j++) symToMap[mapSyms[j]] = j;
 
     for (int k = 0; k != (int)cs.size(); k++) {
         Elf64_Rel* rel = (Elf64_Rel*)(cs[k].rel_data.data());
@@ -699,25 +1391,590 @@ static void applyMapRelo(ifstream& elfFile, vector<unique_fd> &mapFds, vector<co
 
         for (int i = 0; i < n_rel; i++) {
             int symIndex = ELF64_R_SYM(rel[i].r_info);
-            string symName;
+            if (symIndex >= elf.symnum) return;
 
-            ret = getSymNameByIdx(elfFile, symIndex, symName);
-            if (ret) return;
+            int j = symToMap[symIndex];
+            if (j != -1) cs[k].relos.push_back({rel[i].r_offset, static_cast<uint32_t>(j)});
+        }
+    }
+}
 
-            /* Find the map fd and apply relo */
-            for (int j = 0; j < (int)mapNames.size(); j++) {
-                if (!mapNames[j].compare(symName)) {
-                    applyRelo(cs[k].data.data(), rel[i].r_offset, mapFds[j]);
-                    break;
-                }
+/* Patch the map fds into the code, mapFds is indexed like the object's maps */
+void applyMapRelo(vector<unique_fd>& mapFds, vector<codeSection>& cs) {
+    for (auto& c : cs) {
+        for (const auto& relo : c.relos) {
+            if (relo.mapIdx < mapFds.size()) applyRelo(c.data, relo.offset, mapFds[relo.mapIdx]);
+        }
+    }
+}
+
+/* Run fn(0) .. fn(n - 1) on up to maxThreads threads, including the calling one */
+static void parallelFor(int n, int maxThreads, const std::function<void(int)>& fn) {
+    int numThreads = std::min(n, maxThreads);
+    if (numThreads <= 1) {
+        for (int i = 0; i < n; i++) fn(i);
+        return;
+    }
+
+    std::atomic<int> next(0);
+    auto worker = [&]() {
+        for (int i = next++; i < n; i = next++) fn(i);
+    };
+
+    vector<std::thread> threads;
+    for (int t = 1; t < numThreads; t++) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+}
+
+static int getLoadThreads() {
+    int cpus = std::thread::hardware_concurrency();
+    return std::clamp(cpus, 1, BPF_LOAD_MAX_THREADS);
+}
+
+/*
+ * Threads besides the calling one which may load at the same time, getLoadThreads() in all.
+ * Objects loaded concurrently (loadTargets()) take their workers from it and then share what
+ * is left for verifying their programs, rather than each starting getLoadThreads() of its own.
+ */
+class threadBudget {
+  public:
+    explicit threadBudget(int n) : mFree(n) {}
+
+    // Takes up to n threads, returns how many it got
+    int take(int n) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        int got = std::clamp(mFree, 0, n);
+        mFree -= got;
+        return got;
+    }
+    void give(int n) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mFree += n;
+    }
+
+  private:
+    std::mutex mMutex;
+    int mFree;
+};
+
+static threadBudget sSpareThreads(getLoadThreads() - 1);
+
+/*
+ * Optional programs the verifier rejected, remembered across boots (see setLoadFailureCache)
+ * so they aren't verified again only to fail again. One line per program:
+ *   <kernel build> <object path> <object hash> <program name>
+ * Entries for another kernel build are dropped when the file is read, the ones for an earlier
+ * version of an object when that object is next loaded.
+ */
+class loadFailureCache {
+  public:
+    void setPath(const string& path) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mPath = path;
+        mLoaded = false;
+        mDirty = false;
+        mEntries.clear();
+    }
+
+    bool enabled() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return !mPath.empty();
+    }
+
+    bool contains(const string& objPath, uint64_t objHash, const string& progName) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        readLocked();
+
+        auto stale = [&](const entry& e) { return e.objPath == objPath && e.objHash != objHash; };
+        auto end = std::remove_if(mEntries.begin(), mEntries.end(), stale);
+        if (end != mEntries.end()) {
+            mEntries.erase(end, mEntries.end());
+            mDirty = true;
+        }
+
+        for (const auto& e : mEntries) {
+            if (e.objPath == objPath && e.progName == progName) return true;
+        }
+        return false;
+    }
+
+    void add(const string& objPath, uint64_t objHash, const string& progName) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        readLocked();
+        mEntries.push_back({objPath, objHash, progName});
+        mDirty = true;
+    }
+
+    // Writes the cache back if it changed, replacing the file atomically
+    void save() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mDirty) return;
+
+        string out;
+        for (const auto& e : mEntries) {
+            out += android::base::StringPrintf("%s %s %016" PRIx64 " %s\n", mKernelBuild.c_str(),
+                                               e.objPath.c_str(), e.objHash, e.progName.c_str());
+        }
+        string tmpPath = mPath + ".tmp";
+        if (!android::base::WriteStringToFile(out, tmpPath) ||
+            rename(tmpPath.c_str(), mPath.c_str())) {
+            ALOGW("Failed to write %s: %s", mPath.c_str(), strerror(errno));
+            unlink(tmpPath.c_str());
+            return;
+        }
+        mDirty = false;
+    }
+
+  private:
+    struct entry {
+        string objPath;
+        uint64_t objHash;
+        string progName;
+    };
+
+    void readLocked() {
+        if (mLoaded) return;
+        mLoaded = true;
+
+        struct utsname uts;
+        if (uname(&uts)) return;
+        string build = string(uts.release) + ' ' + uts.version;
+        mKernelBuild = android::base::StringPrintf(
+                "%016" PRIx64, hashElfObject(build.data(), build.size()));
+
+        string contents;
+        if (!android::base::ReadFileToString(mPath, &contents)) return;
+        for (const auto& line : android::base::Split(contents, "\n")) {
+            vector<string> fields = android::base::Split(line, " ");
+            if (fields.size() != 4) continue;
+            if (fields[0] != mKernelBuild) {
+                mDirty = true;
+                continue;
+            }
+            mEntries.push_back({fields[1], strtoull(fields[2].c_str(), nullptr, 16), fields[3]});
+        }
+    }
+
+    std::mutex mMutex;
+    string mPath;
+    bool mLoaded = false;
+    bool mDirty = false;
+    string mKernelBuild;
+    vector<entry> mEntries;
+};
+
+static loadFailureCache sFailureCache;
+
+void setLoadFailureCache(const string& path) {
+    sFailureCache.setPath(path);
+}
+
+// Rejections which the same code on the same kernel will get again, as opposed to ie. ENOMEM
+static bool isPermanentLoadFailure(int err) {
+    return err == EACCES || err == EINVAL || err == E2BIG;
+}
+
+typedef struct {
+    bool skip;     /* excluded by kernel version */
+    bool reuse;    /* already pinned */
+    bool replace;  /* pinned, but a different program */
+    string progPinLoc;
+    int load_errno;  /* of a failed BPF_PROG_LOAD */
+    string log;      /* verifier log of a failed BPF_PROG_LOAD */
+    int64_t loadUs;  /* time spent in BPF_PROG_LOAD, including retries */
+    bool hasStats;   /* whether the kernel reported stats */
+    VerifierStats stats;
+    string dedupKey; /* see progDedupKey() */
+    bool shared;     /* an identical program was loaded already, by another object */
+    bool deferred;   /* a variant, only tried if the previous one fails */
+    int nextVariant; /* index of the next variant of the program, 0 if none */
+    int64_t replacedBytes; /* size of the pinned program this replaces */
+    int64_t charged;       /* chargeMemory()'d before verifying, see chargeProgram() */
+    bool overBudget;       /* not verified, as it didn't fit in the budget */
+} progLoadState;
+
+/*
+ * Programs loaded by this process, by progDedupKey(): identical programs of different objects
+ * (ie. a helper built into several of them) are only verified and held in kernel memory once,
+ * and pinned at each object's path. Holds an fd of every program, until cleared.
+ */
+class progRegistry {
+  public:
+    /*
+     * An fd of the program loaded for key, waiting for it if another thread is loading it.
+     * -1 if there is none, then the caller has to load it and publish() the result.
+     */
+    int acquire(const string& key) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true) {
+            auto [it, inserted] = mProgs.try_emplace(key, 0);
+            if (inserted) return -1;
+            if (!it->second) {
+                mPublished.wait(lock);
+                continue;
             }
+            int fd = getFdById(it->second);
+            if (fd < 0) it->second = 0;  // the caller loads it again
+            return fd;
+        }
+    }
+
+    /* The result of loading key after acquire() returned -1, fd is invalid if that failed */
+    void publish(const string& key, const unique_fd& fd) {
+        struct bpf_prog_info info;
+        unique_fd held;
+        if (fd.ok() && !getObjectInfo(fd.get(), info)) held.reset(getFdById(info.id));
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (held.ok()) {
+            mProgs[key] = info.id;
+            mFds.push_back(std::move(held));
+        } else {
+            mProgs.erase(key);
+        }
+        mPublished.notify_all();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mProgs.clear();
+        mFds.clear();
+    }
+
+  private:
+    static int getFdById(uint32_t id) {
+        union bpf_attr req = {
+            .prog_id = id,
+        };
+        return getBpfBackend().bpf(BPF_PROG_GET_FD_BY_ID, req);
+    }
+
+    std::mutex mMutex;
+    std::condition_variable mPublished;
+    std::unordered_map<string, uint32_t> mProgs;  // key -> program id, 0 while being loaded
+    vector<unique_fd> mFds;
+};
+
+static progRegistry sProgRegistry;
+
+static void clearRegistries() {
+    sMapRegistry.clear();
+    sProgRegistry.clear();
+}
+
+/*
+ * What makes two programs interchangeable: their name, type, expected attach type and license,
+ * and their relocated code, with the map fds (which differ between objects) replaced by the ids
+ * of the maps. The name is included so a shared program shows up (eg. in bpftool) under its
+ * own name rather than under that of whichever same-code program was loaded first. mapIds
+ * caches the ids by fd.
+ */
+static string progDedupKey(const codeSection& cs, const string& license,
+                           std::unordered_map<int, uint32_t>& mapIds) {
+    const struct bpf_insn* insns = reinterpret_cast<const struct bpf_insn*>(cs.data.data());
+    vector<struct bpf_insn> code(insns, insns + cs.data.size() / sizeof(struct bpf_insn));
+
+    for (size_t i = 0; i + 1 < code.size(); i++) {
+        if (code[i].code != (BPF_LD | BPF_IMM | BPF_DW)) continue;
+        if (code[i].src_reg == BPF_PSEUDO_MAP_FD) {
+            auto [it, inserted] = mapIds.try_emplace(code[i].imm, 0);
+            struct bpf_map_info info;
+            if (inserted && !getObjectInfo(code[i].imm, info)) it->second = info.id;
+            if (!it->second) return "";  // can't tell which map this is
+            code[i].imm = it->second;
+        }
+        i++;
+    }
+
+    uint32_t types[] = {cs.type, cs.expected_attach_type};
+    string data(reinterpret_cast<const char*>(types), sizeof(types));
+    data.append(cs.name.c_str(), cs.name.size() + 1);
+    data.append(license.c_str(), license.size() + 1);
+    data.append(reinterpret_cast<const char*>(code.data()), code.size() * sizeof(code[0]));
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(data.data()), data.size(), digest);
+    return string(reinterpret_cast<const char*>(digest), sizeof(digest));
+}
+
+// Set to load every program with verifier logging on, as opposed to only retrying failed
+// loads with it (verbose logging slows the verifier down considerably).
+static bool forceVerifierLog() {
+    static const bool force = android::base::GetBoolProperty("debug.bpfloader.verifier_log", false);
+    return force;
+}
+
+/* Issue BPF_PROG_LOAD, logging at logLevel into log_buf if it is not empty */
+static int bpfProgLoad(codeSection& cs, const string& license, unsigned kvers,
+                       vector<char>& log_buf, unsigned logLevel) {
+    if (!log_buf.empty()) log_buf[0] = '\0';
+
+    union bpf_attr req = {
+      .prog_type = cs.type,
+      .kern_version = kvers,
+      .license = ptr_to_u64(license.c_str()),
+      .insns = ptr_to_u64(cs.data.data()),
+      .insn_cnt = static_cast<__u32>(cs.data.size() / sizeof(struct bpf_insn)),
+      .log_level = log_buf.empty() ? 0u : logLevel,
+      .log_buf = ptr_to_u64(log_buf.empty() ? nullptr : log_buf.data()),
+      .log_size = static_cast<__u32>(log_buf.size()),
+      .expected_attach_type = cs.expected_attach_type,
+    };
+    setObjName(req.prog_name, cs.name);
+    return getBpfBackend().bpf(BPF_PROG_LOAD, req);
+}
+
+/*
+ * Parse the statistics the verifier logs at BPF_LOAD_LOG_STATS, ie.
+ *   verification time 87 usec
+ *   stack depth 40
+ *   processed 120 insns (limit 1000000) max_states_per_insn 1 total_states 9 peak_states 9 ...
+ */
+static bool parseVerifierStats(const char* log, VerifierStats& stats) {
+    const char* time = strstr(log, "verification time ");
+    const char* processed = strstr(log, "processed ");
+
+    return time && processed &&
+           sscanf(time, "verification time %" SCNd64, &stats.verificationUs) == 1 &&
+           sscanf(processed,
+                  "processed %" SCNd64 " insns (limit %*d) max_states_per_insn %*d "
+                  "total_states %" SCNd64 " peak_states %" SCNd64,
+                  &stats.insnsProcessed, &stats.totalStates, &stats.peakStates) == 3;
+}
+
+/*
+ * Verifier log buffers, kept for the life of the process so that they are only allocated once
+ * per concurrent load: parallelFor() runs every object's programs on new threads.
+ */
+class bufferPool {
+  public:
+    vector<char> take() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mBuffers.empty()) return {};
+        vector<char> buf = std::move(mBuffers.back());
+        mBuffers.pop_back();
+        return buf;
+    }
+    void give(vector<char>&& buf) {
+        if (buf.empty()) return;
+        std::lock_guard<std::mutex> lock(mMutex);
+        mBuffers.push_back(std::move(buf));
+    }
+
+  private:
+    std::mutex mMutex;
+    vector<vector<char>> mBuffers;
+};
+
+static bufferPool sLogBuffers;
+static bufferPool sStatsBuffers;
+
+/* Verify one program, this may run concurrently with other programs of the same object */
+static void loadProgram(const char* elfPath, codeSection& cs, progLoadState& st,
+                        const string& license, unsigned kvers) {
+    vector<char> no_log;
+    ScopedTiming loadTiming(st.loadUs);
+
+    if (!st.dedupKey.empty()) {
+        cs.prog_fd.reset(sProgRegistry.acquire(st.dedupKey));
+        st.shared = cs.prog_fd.ok();
+        if (st.shared) {
+            ALOGD("%s (%s) is identical to a program loaded already", elfPath, cs.name.c_str());
+            return;
+        }
+    }
+
+    // Reused across loads (see bufferPool), and only allocated once needed
+    vector<char> log_buf = sLogBuffers.take();
+    vector<char> stats_buf = sStatsBuffers.take();
+
+    // Statistics are cheap, unlike verbose logging, so always ask for them (5.2+ kernels)
+    unsigned stats = kvers >= KVER(5, 2, 0) ? BPF_LOAD_LOG_STATS : 0;
+    if (stats && stats_buf.empty()) stats_buf.resize(BPF_LOAD_STATS_LOG_SZ);
+    if (forceVerifierLog()) log_buf.resize(BPF_LOAD_LOG_SZ);
+
+    vector<char>& buf = forceVerifierLog() ? log_buf : stats ? stats_buf : no_log;
+    cs.prog_fd.reset(bpfProgLoad(cs, license, kvers, buf,
+                                 (forceVerifierLog() ? BPF_LOAD_LOG_VERBOSE : 0) | stats));
+    if (cs.prog_fd.ok() && stats) {
+        st.hasStats = parseVerifierStats(buf.data(), st.stats);
+        if (!st.hasStats) ALOGW("no verifier stats for %s (%s)", elfPath, cs.name.c_str());
+    }
+
+    // Retry failed loads with logging, growing the buffer until the log fits (ENOSPC means
+    // it was truncated) or reaches BPF_LOAD_LOG_SZ.
+    if (!cs.prog_fd.ok() && !forceVerifierLog()) {
+        if (log_buf.empty()) log_buf.resize(BPF_LOAD_LOG_MIN_SZ);
+        while (true) {
+            cs.prog_fd.reset(bpfProgLoad(cs, license, kvers, log_buf, BPF_LOAD_LOG_VERBOSE));
+            if (cs.prog_fd.ok() || errno != ENOSPC || log_buf.size() >= BPF_LOAD_LOG_SZ) break;
+            log_buf.resize(std::min<size_t>(log_buf.size() * 2, BPF_LOAD_LOG_SZ));
+        }
+    }
+
+    if (!cs.prog_fd.ok()) {
+        st.load_errno = errno;
+        st.log = string(log_buf.data(), strnlen(log_buf.data(), log_buf.size()));
+        ALOGW("BPF_PROG_LOAD call for %s (%s) returned fd: %d (%s)", elfPath, cs.name.c_str(),
+              cs.prog_fd.get(), std::strerror(st.load_errno));
+    }
+    if (!st.dedupKey.empty()) sProgRegistry.publish(st.dedupKey, cs.prog_fd);
+    sLogBuffers.give(std::move(log_buf));
+    sStatsBuffers.give(std::move(stats_buf));
+}
+
+/*
+ * Like the kernel's bpf_prog_calc_tag(): the first BPF_TAG_SIZE bytes of the SHA1 (or, on
+ * newer kernels, SHA256) of the instructions, with the immediates of map references zeroed.
+ */
+void calcProgTag(const struct bpf_insn* insns, size_t count, bool sha256,
+                 uint8_t tag[BPF_TAG_SIZE]) {
+    vector<struct bpf_insn> raw(insns, insns + count);
+    bool wasLdMap = false;
+
+    for (auto& insn : raw) {
+        if (!wasLdMap && insn.code == (BPF_LD | BPF_IMM | BPF_DW) &&
+            (insn.src_reg == BPF_PSEUDO_MAP_FD || insn.src_reg == BPF_PSEUDO_MAP_VALUE)) {
+            wasLdMap = true;
+            insn.imm = 0;
+        } else if (wasLdMap && !insn.code && !insn.dst_reg && !insn.src_reg && !insn.off) {
+            wasLdMap = false;
+            insn.imm = 0;
+        } else {
+            wasLdMap = false;
         }
     }
+
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(raw.data());
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    if (sha256) {
+        SHA256(data, raw.size() * sizeof(raw[0]), digest);
+    } else {
+        SHA1(data, raw.size() * sizeof(raw[0]), digest);
+    }
+    memcpy(tag, digest, BPF_TAG_SIZE);
+}
+
+/*
+ * Whether the pinned program, of which info is the info, is the one in cs, by comparing the
+ * kernel's tag of it with ours. This relies on cs being relocated already. mapIds are the ids of
+ * the object's maps by fd.
+ */
+static bool pinnedProgMatches(const unique_fd& fd, struct bpf_prog_info info,
+                              const codeSection& cs,
+                              const std::unordered_map<int, uint32_t>& mapIds) {
+    const struct bpf_insn* insns = reinterpret_cast<const struct bpf_insn*>(cs.data.data());
+    size_t count = cs.data.size() / sizeof(struct bpf_insn);
+    uint8_t tag[BPF_TAG_SIZE];
+
+    bool match = false;
+    for (bool sha256 : {false, true}) {
+        calcProgTag(insns, count, sha256, tag);
+        if (!memcmp(tag, info.tag, BPF_TAG_SIZE)) match = true;
+    }
+    if (!match || !mapsMigrated()) return match;
+
+    // The tag doesn't cover map references, and programs keep using the map they were loaded
+    // with: after a migration, compare the ids of the maps too.
+    vector<__u32> ids(info.nr_map_ids);
+    union bpf_attr req = {
+      .info = {
+        .bpf_fd = static_cast<__u32>(fd.get()),
+        .info_len = sizeof(info),
+        .info = ptr_to_u64(&info),
+      },
+    };
+    info = {};
+    info.nr_map_ids = ids.size();
+    info.map_ids = ptr_to_u64(ids.data());
+    if (getBpfBackend().bpf(BPF_OBJ_GET_INFO_BY_FD, req)) return true;
+    ids.resize(std::min<size_t>(ids.size(), info.nr_map_ids));
+
+    vector<__u32> expected;
+    for (size_t i = 0; i + 1 < count; i++) {
+        if (insns[i].code != (BPF_LD | BPF_IMM | BPF_DW)) continue;
+        if (insns[i].src_reg == BPF_PSEUDO_MAP_FD) {
+            auto it = mapIds.find(insns[i].imm);
+            if (it != mapIds.end()) expected.push_back(it->second);
+        }
+        i++;
+    }
+    std::sort(ids.begin(), ids.end());
+    std::sort(expected.begin(), expected.end());
+    expected.erase(std::unique(expected.begin(), expected.end()), expected.end());
+    return ids == expected;
+}
+
+/* objHash is the object's hashElfObject(), to look up sFailureCache with, or 0 not to */
+/*
+ * Whether cs needs loading, as opposed to reusing the program pinned at st.progPinLoc. A pinned
+ * program which isn't cs (ie. of an updated object) is to be replaced by it, and if it can't be
+ * told whether it is, it's assumed to be.
+ */
+static bool needsLoad(codeSection& cs, progLoadState& st,
+                      const std::unordered_map<int, uint32_t>& mapIds) {
+    if (getBpfBackend().access(st.progPinLoc.c_str(), F_OK)) return true;
+
+    cs.prog_fd.reset(retrieveObjectRO(st.progPinLoc.c_str()));
+    ALOGV("New bpf prog load reusing prog %s, ret: %d (%s)", st.progPinLoc.c_str(),
+          cs.prog_fd.get(), (!cs.prog_fd.ok() ? std::strerror(errno) : "no error"));
+    struct bpf_prog_info info;
+    bool noInfo = cs.prog_fd.ok() && getObjectInfo(cs.prog_fd, info);
+    if (noInfo) ALOGW("Couldn't get info of pinned prog %s [%d]", cs.name.c_str(), errno);
+    if (!cs.prog_fd.ok() || noInfo || pinnedProgMatches(cs.prog_fd, info, cs, mapIds)) {
+        st.reuse = true;
+        return false;
+    }
+    st.replacedBytes = info.jited_prog_len ? info.jited_prog_len : info.xlated_prog_len;
+    ALOGI("pinned prog %s differs from %s, replacing it", st.progPinLoc.c_str(),
+          cs.name.c_str());
+    cs.prog_fd.reset();
+    st.replace = true;
+    return true;
+}
+
+static int pinProgram(const unique_fd& fd, const string& pinLoc, const struct bpf_prog_def& pd) {
+    int ret = pinObject(fd, pinLoc.c_str());
+    if (ret) {
+        int err = errno;
+        ALOGE("create %s -> %d [%d:%s]", pinLoc.c_str(), ret, err, strerror(err));
+        return -err;
+    }
+    if (getBpfBackend().chmod(pinLoc.c_str(), 0440)) {
+        int err = errno;
+        ALOGE("chmod %s 0440 -> [%d:%s]", pinLoc.c_str(), err, strerror(err));
+        return -err;
+    }
+    if (getBpfBackend().chown(pinLoc.c_str(), (uid_t)pd.uid, (gid_t)pd.gid)) {
+        int err = errno;
+        ALOGE("chown %s %d %d -> [%d:%s]", pinLoc.c_str(), pd.uid, pd.gid, err, strerror(err));
+        return -err;
+    }
+    return 0;
+}
+
+/*
+ * Programs are charged for before they are verified, with the size of their instructions less
+ * that of the pinned program they replace, and settled once the kernel reports their size.
+ */
+static bool chargeProgram(const char* elfPath, const codeSection& cs, progLoadState& st) {
+    int64_t bytes = (int64_t)cs.data.size() - st.replacedBytes;
+    if (!chargeMemory(bytes)) {
+        ALOGE("not loading program %s of %s", cs.name.c_str(), elfPath);
+        st.overBudget = true;
+        return false;
+    }
+    st.charged = bytes;
+    return true;
 }
 
 static int loadCodeSections(const char* elfPath, vector<codeSection>& cs, const string& license,
-                            const char* prefix) {
-    unsigned kvers = kernelVersion();
+                            std::unordered_map<int, uint32_t>& mapIds, const char* prefix,
+                            uint64_t objHash, LoadTimings& timings, LoadFootprint& footprint,
+                            vector<VerifierStats>& verifierStats) {
+    kernelProbe& probe = getKernelProbe();
+    unsigned kvers = probe.kernelVersion();
 
     if (!kvers) {
         ALOGE("unable to get kernel version");
@@ -725,10 +1982,11 @@ static int loadCodeSections(const char* elfPath, vector<codeSection>& cs, const
     }
 
     string objName = pathToObjName(string(elfPath));
+    vector<progLoadState> state(cs.size());
+    vector<int> toLoad;
+    std::unordered_map<string, int> lastVariant;  // by pin location
 
     for (int i = 0; i < (int)cs.size(); i++) {
-        unique_fd& fd = cs[i].prog_fd;
-        int ret;
         string name = cs[i].name;
 
         if (!cs[i].prog_def.has_value()) {
@@ -741,141 +1999,759 @@ static int loadCodeSections(const char* elfPath, vector<codeSection>& cs, const
         if (kvers < min_kver || kvers >= max_kver) {
             ALOGD("skipping program cs[%d].name:%s min_kver:%x max_kver:%x (kvers:%x)",
                   i, name.c_str(), min_kver, max_kver, kvers);
+            state[i].skip = true;
             continue;
         }
 
-        // strip any potential $foo suffix
-        // this can be used to provide duplicate programs
-        // conditionally loaded based on running kernel version
-        name = name.substr(0, name.find_last_of('$'));
+        // No point running the verifier only to learn the kernel doesn't know the program type
+        if (cs[i].prog_def->optional &&
+            !probe.progTypeSupported(cs[i].type, cs[i].expected_attach_type)) {
+            ALOGD("skipping optional program cs[%d].name:%s, kernel lacks type %d", i,
+                  name.c_str(), cs[i].type);
+            state[i].skip = true;
+            continue;
+        }
 
-        bool reuse = false;
-        // Format of pin location is
-        // /sys/fs/bpf/<prefix>prog_<objName>_<progName>
-        string progPinLoc = string(BPF_FS_PATH) + prefix + "prog_" +
-                            objName + '_' + string(name);
-        if (access(progPinLoc.c_str(), F_OK) == 0) {
-            fd.reset(retrieveProgram(progPinLoc.c_str()));
-            ALOGV("New bpf prog load reusing prog %s, ret: %d (%s)", progPinLoc.c_str(), fd.get(),
-                  (!fd.ok() ? std::strerror(errno) : "no error"));
-            reuse = true;
-        } else {
-            vector<char> log_buf(BPF_LOAD_LOG_SZ, 0);
-
-            union bpf_attr req = {
-              .prog_type = cs[i].type,
-              .kern_version = kvers,
-              .license = ptr_to_u64(license.c_str()),
-              .insns = ptr_to_u64(cs[i].data.data()),
-              .insn_cnt = static_cast<__u32>(cs[i].data.size() / sizeof(struct bpf_insn)),
-              .log_level = 1,
-              .log_buf = ptr_to_u64(log_buf.data()),
-              .log_size = static_cast<__u32>(log_buf.size()),
-              .expected_attach_type = cs[i].expected_attach_type,
-            };
-            strlcpy(req.prog_name, cs[i].name.c_str(), sizeof(req.prog_name));
-            fd.reset(bpf(BPF_PROG_LOAD, req));
+        if (objHash && cs[i].prog_def->optional &&
+            sFailureCache.contains(elfPath, objHash, cs[i].name)) {
+            ALOGI("skipping optional program cs[%d].name:%s, it failed to load on this kernel",
+                  i, name.c_str());
+            state[i].skip = true;
+            continue;
+        }
 
-            if (!fd.ok()) {
-                ALOGW("BPF_PROG_LOAD call for %s (%s) returned fd: %d (%s)", elfPath,
-                      cs[i].name.c_str(), fd.get(), std::strerror(errno));
+        state[i].progPinLoc = getProgPinLoc(prefix, objName, name);
+        // Variants of a program share its pin: a later one is only tried if the ones before
+        // it fail, see tryNextVariant below
+        auto [last, first] = lastVariant.try_emplace(state[i].progPinLoc, i);
+        if (!first) {
+            state[last->second].nextVariant = i;
+            last->second = i;
+            state[i].deferred = true;
+            continue;
+        }
+        if (needsLoad(cs[i], state[i], mapIds) && chargeProgram(elfPath, cs[i], state[i])) {
+            toLoad.push_back(i);
+        }
+    }
 
-                vector<string> lines = android::base::Split(log_buf.data(), "\n");
+    // Once maps are created and relocated the programs of an object no longer depend on each
+    // other, so run the (CPU heavy) verifier for all of them concurrently.  Everything with
+    // side effects visible outside this object (pinning, failure handling) stays sequential
+    // and in section order below.
+    for (int i : toLoad) state[i].dedupKey = progDedupKey(cs[i], license, mapIds);
+
+    int extraThreads = sSpareThreads.take((int)toLoad.size() - 1);
+    parallelFor(toLoad.size(), 1 + extraThreads, [&](int n) {
+        int i = toLoad[n];
+        loadProgram(elfPath, cs[i], state[i], license, kvers);
+    });
+    sSpareThreads.give(extraThreads);
+
+    auto account = [&](int i) {
+        timings.progLoadUs += state[i].loadUs;
+        timings.progLoads.emplace_back(cs[i].name, state[i].loadUs);
+        if (!state[i].hasStats) return;
+
+        const VerifierStats& st = state[i].stats;
+        ALOGD("prog %s verified in %" PRId64 "us: %" PRId64 " insns processed, %" PRId64
+              " states, peak %" PRId64, cs[i].name.c_str(), st.verificationUs, st.insnsProcessed,
+              st.totalStates, st.peakStates);
+        verifierStats.push_back(st);
+        verifierStats.back().prog = cs[i].name;
+    };
+    for (int i : toLoad) account(i);
+
+    // An optional variant which failed leaves the pin to the next variant of the program, as
+    // the next one comes later in section order it is loaded before the loop below gets to it.
+    auto tryNextVariant = [&](int i) {
+        int next = state[i].nextVariant;
+        if (!next) return;
+        ALOGI("trying variant cs[%d].name:%s instead", next, cs[next].name.c_str());
+        state[next].deferred = false;
+        if (!needsLoad(cs[next], state[next], mapIds)) return;
+        if (!chargeProgram(elfPath, cs[next], state[next])) return;
+        state[next].dedupKey = progDedupKey(cs[next], license, mapIds);
+        loadProgram(elfPath, cs[next], state[next], license, kvers);
+        account(next);
+    };
+
+    for (int i = 0; i < (int)cs.size(); i++) {
+        if (state[i].skip || state[i].deferred) continue;
 
-                ALOGW("BPF_PROG_LOAD - BEGIN log_buf contents:");
-                for (const auto& line : lines) ALOGW("%s", line.c_str());
-                ALOGW("BPF_PROG_LOAD - END log_buf contents.");
+        unique_fd& fd = cs[i].prog_fd;
+        const string& progPinLoc = state[i].progPinLoc;
+        int ret;
 
-                if (cs[i].prog_def->optional) {
-                    ALOGW("failed program is marked optional - continuing...");
-                    continue;
+        if (state[i].overBudget) {
+            if (!cs[i].prog_def->optional) return -ENOMEM;
+            tryNextVariant(i);
+            continue;
+        }
+        if (!state[i].reuse && (!fd.ok() || state[i].shared)) refundMemory(state[i].charged);
+
+        if (!state[i].reuse && !fd.ok()) {
+            vector<string> lines = android::base::Split(state[i].log, "\n");
+
+            ALOGW("BPF_PROG_LOAD - BEGIN log_buf contents:");
+            for (const auto& line : lines) ALOGW("%s", line.c_str());
+            ALOGW("BPF_PROG_LOAD - END log_buf contents.");
+
+            if (cs[i].prog_def->optional) {
+                ALOGW("failed program is marked optional - continuing...");
+                if (objHash && isPermanentLoadFailure(state[i].load_errno)) {
+                    sFailureCache.add(elfPath, objHash, cs[i].name);
                 }
-                ALOGE("non-optional program failed to load.");
+                tryNextVariant(i);
+                continue;
             }
+            ALOGE("non-optional program failed to load.");
         }
 
         if (!fd.ok()) return fd.get();
 
-        if (!reuse) {
-            ret = bpfFdPin(fd, progPinLoc.c_str());
-            if (ret) {
-                int err = errno;
-                ALOGE("create %s -> %d [%d:%s]", progPinLoc.c_str(), ret, err, strerror(err));
-                return -err;
-            }
-            if (chmod(progPinLoc.c_str(), 0440)) {
-                int err = errno;
-                ALOGE("chmod %s 0440 -> [%d:%s]", progPinLoc.c_str(), err, strerror(err));
-                return -err;
+        struct bpf_prog_info info;
+        int infoErr = getObjectInfo(fd.get(), info) ? errno : 0;
+
+        if (!state[i].reuse && !state[i].shared) {
+            if (infoErr) {
+                ALOGW("no prog info for %s: %s", cs[i].name.c_str(), strerror(infoErr));
             }
-            if (chown(progPinLoc.c_str(), (uid_t)cs[i].prog_def->uid,
-                      (gid_t)cs[i].prog_def->gid)) {
-                int err = errno;
-                ALOGE("chown %s %d %d -> [%d:%s]", progPinLoc.c_str(), cs[i].prog_def->uid,
-                      cs[i].prog_def->gid, err, strerror(err));
-                return -err;
+            int64_t bytes = info.jited_prog_len ? info.jited_prog_len : info.xlated_prog_len;
+            // Settle the estimate chargeProgram() made, this may charge more but it's too late
+            // to refuse the program now
+            if (!infoErr) refundMemory(state[i].charged - (bytes - state[i].replacedBytes));
+            footprint.progXlatedBytes += info.xlated_prog_len;
+            footprint.progJitedBytes += info.jited_prog_len;
+            footprint.progs.emplace_back(cs[i].name, bytes);
+        }
+
+        if (!state[i].reuse) {
+            ScopedTiming pinTiming(timings.pinUs);
+            // A changed program is pinned next to the old one and renamed over it, like a
+            // migrated map, so the pin path never goes missing
+            BpfBackend& backend = getBpfBackend();
+            string pinLoc = state[i].replace ? progPinLoc + "_replacing" : progPinLoc;
+            if (state[i].replace) backend.unlink(pinLoc.c_str());  // left over by an interruption
+            ret = pinProgram(fd, pinLoc, *cs[i].prog_def);
+            if (!ret && state[i].replace && backend.rename(pinLoc.c_str(), progPinLoc.c_str())) {
+                ret = -errno;
+                ALOGE("rename %s -> [%d:%s]", progPinLoc.c_str(), -ret, strerror(-ret));
             }
+            if (ret && state[i].replace) backend.unlink(pinLoc.c_str());
+            if (ret) return ret;
         }
 
-        int progId = bpfGetFdProgId(fd);
-        if (progId == -1) {
-            ALOGE("bpfGetFdProgId failed, ret: %d [%d]", progId, errno);
+        if (infoErr) {
+            ALOGE("getObjectInfo of prog %s failed [%d]", progPinLoc.c_str(), infoErr);
         } else {
-            ALOGD("prog %s id %d", progPinLoc.c_str(), progId);
+            ALOGD("prog %s id %u", progPinLoc.c_str(), info.id);
         }
     }
 
     return 0;
 }
 
-int loadProg(const char* elfPath, bool* isCritical, const Location& location) {
-    vector<char> license;
-    vector<char> critical;
-    vector<codeSection> cs;
+/* Everything loadProg needs to carry from one stage of loading an object to the next */
+struct objectState : objectContents {
+    string elfPath;
+    ElfObject elf;
+    PackObject pack;
     vector<unique_fd> mapFds;
-    int ret;
+    std::unordered_map<int, uint32_t> mapIds;  // by fd, from the maps' info
+    LoadTimings timings;
+    LoadFootprint footprint;
+    vector<VerifierStats> verifierStats;
+};
 
-    if (!isCritical) return -1;
-    *isCritical = false;
+static int readElfContents(objectState& obj, const Location& location) {
+    const char* elfPath = obj.elfPath.c_str();
+    sectionView license;
+    sectionView critical;
+    int ret;
 
-    ifstream elfFile(elfPath, ios::in | ios::binary);
-    if (!elfFile.is_open()) return -1;
+    ret = mapElfObject(elfPath, obj.elf);
+    if (ret) {
+        ALOGE("Couldn't parse ELF object %s", elfPath);
+        return ret;
+    }
 
-    ret = readSectionByName("critical", elfFile, critical);
-    *isCritical = !ret;
+    ret = readSectionByName("critical", obj.elf, critical);
+    obj.isCritical = !ret;
+    obj.critical = string(critical.data(), strnlen(critical.data(), critical.size()));
 
-    ret = readSectionByName("license", elfFile, license);
+    ret = readSectionByName("license", obj.elf, license);
     if (ret) {
         ALOGE("Couldn't find license in %s", elfPath);
         return ret;
     }
+    obj.license = string(license.data(), strnlen(license.data(), license.size()));
 
-    ALOGI("Platform BpfLoader loading %s%s ELF object %s with license %s",
-          *isCritical ? "critical for " : "optional", *isCritical ? (char*)critical.data() : "",
-          elfPath, (char*)license.data());
-
-    ret = readCodeSections(elfFile, cs, location.allowedProgTypes, location.allowedProgTypesLength);
+    const loadEnv env = getLoadEnv();
+    ret = readCodeSections(obj.elf, obj.cs, location.allowedProgTypes,
+                           location.allowedProgTypesLength, &env);
     if (ret) {
         ALOGE("Couldn't read all code sections in %s", elfPath);
         return ret;
     }
 
-    ret = createMaps(elfPath, elfFile, mapFds, location.prefix);
+    ret = readMapDefs(obj.elf, obj.md, obj.mapNames);
+    if (ret == -2) return 0;  // no maps to read
+    if (ret) return ret;
+
+    ret = readMapScaling(obj.elf, obj.scaling);
+    if (ret) return ret;
+
+    resolveMapRelos(obj.elf, obj.cs);
+    return 0;
+}
+
+static unsigned int getRamGiB() {
+    struct sysinfo si;
+    if (sysinfo(&si)) return 0;
+    // totalram is short of the nominal size by what the kernel reserves, round it up to that
+    return ((uint64_t)si.totalram * si.mem_unit + (1ULL << 30) - 1) >> 30;
+}
+
+/* Apply BPF_MAP_SCALING() and ro.bpfloader.max_entries.* to the map definitions */
+static void scaleMaps(objectContents& obj, const string& elfPath, const char* prefix) {
+    static const unsigned int cpus = getNumPossibleCpus();
+    static const unsigned int ramGiB = getRamGiB();
+    string objName = pathToObjName(elfPath);
+
+    for (size_t i = 0; i < obj.md.size() && i < obj.mapNames.size(); i++) {
+        struct bpf_map_def& md = obj.md[i];
+        unsigned int maxEntries = md.max_entries;
+
+        for (const auto& s : obj.scaling) {
+            if (obj.mapNames[i] != s.map_name) continue;
+            uint64_t scaled = std::max<uint64_t>({maxEntries, (uint64_t)s.per_cpu * cpus,
+                                                  (uint64_t)s.per_gib * ramGiB});
+            if (s.max) scaled = std::min<uint64_t>(scaled, std::max(s.max, md.max_entries));
+            maxEntries = std::min<uint64_t>(scaled, 1U << 31);
+        }
+
+        string pinName = getMapPinLoc(prefix, objName, md, obj.mapNames[i]);
+        pinName = pinName.substr(strlen(BPF_FS_PATH));
+        std::replace(pinName.begin(), pinName.end(), '/', '.');
+        string property = getBpfBackend().getProperty("ro.bpfloader.max_entries." + pinName);
+        unsigned int override;
+        if (android::base::ParseUint(property, &override, 1U << 31) && override) {
+            maxEntries = override;
+        }
+
+        if (maxEntries != md.max_entries && md.type == BPF_MAP_TYPE_RINGBUF) {
+            // The kernel only takes power of 2 multiples of the page size
+            maxEntries = std::max<unsigned int>(maxEntries, getpagesize());
+            while (maxEntries & (maxEntries - 1)) maxEntries += maxEntries & -maxEntries;
+        }
+
+        if (maxEntries != md.max_entries) {
+            ALOGI("map %s of %s: max_entries %u -> %u", obj.mapNames[i].c_str(), elfPath.c_str(),
+                  md.max_entries, maxEntries);
+            md.max_entries = maxEntries;
+        }
+    }
+}
+
+/* Stage 1: parse the object (or its bpfpack), this has no side effects outside of the process */
+static int readObject(objectState& obj, const Location& location) {
+    ScopedTiming parseTiming(obj.timings.parseUs);
+    ScopedTiming totalTiming(obj.timings.totalUs);
+    const char* elfPath = obj.elfPath.c_str();
+    int ret;
+
+    const loadEnv env = getLoadEnv();
+    ret = readBpfPack(elfPath, obj.pack, obj, location.allowedProgTypes,
+                      location.allowedProgTypesLength, &env);
+    if (ret) {
+        if (ret != -ENOENT) ALOGW("Ignoring bpfpack of %s (ret=%d)", elfPath, ret);
+        ret = readElfContents(obj, location);
+        if (ret) return ret;
+    }
+    scaleMaps(obj, obj.elfPath, location.prefix);
+
+    ALOGI("Platform BpfLoader loading %s%s %s object %s with license %s",
+          obj.isCritical ? "critical for " : "optional", obj.isCritical ? obj.critical.c_str() : "",
+          obj.pack.base ? "packed" : "ELF", elfPath, obj.license.c_str());
+    return 0;
+}
+
+/* Stage 2: create (or reuse) and pin the maps, then relocate the code against them */
+static int createObjectMaps(objectState& obj, const Location& location) {
+    ScopedTiming totalTiming(obj.timings.totalUs);
+    const char* elfPath = obj.elfPath.c_str();
+    int ret;
+
+    {
+        // map pinning is accounted separately, in pinUs
+        int64_t pinUs = obj.timings.pinUs;
+        ScopedTiming mapsTiming(obj.timings.mapsUs);
+        ret = createMaps(elfPath, obj.md, obj.mapNames, obj.mapFds, obj.mapIds,
+                         location.prefix, obj.timings, obj.footprint);
+        obj.timings.mapsUs -= obj.timings.pinUs - pinUs;
+    }
     if (ret) {
         ALOGE("Failed to create maps: (ret=%d) in %s", ret, elfPath);
         return ret;
     }
 
-    for (int i = 0; i < (int)mapFds.size(); i++)
-        ALOGV("map_fd found at %d is %d in %s", i, mapFds[i].get(), elfPath);
+    for (int i = 0; i < (int)obj.mapFds.size(); i++)
+        ALOGV("map_fd found at %d is %d in %s", i, obj.mapFds[i].get(), elfPath);
 
-    applyMapRelo(elfFile, mapFds, cs);
+    ScopedTiming reloTiming(obj.timings.reloUs);
+    applyMapRelo(obj.mapFds, obj.cs);
+    return 0;
+}
+
+static uint64_t objectHash(const objectState& obj) {
+    if (obj.pack.base) {
+        return packedHash(reinterpret_cast<const bpfPackHeader*>(obj.pack.base)->elfSha256);
+    }
+    return hashElfObject(obj.elf.base, obj.elf.size);
+}
+
+/* Stage 3: verify and pin the programs */
+static int loadObjectPrograms(objectState& obj, const Location& location) {
+    ScopedTiming totalTiming(obj.timings.totalUs);
+
+    // Only hash objects the failure cache could apply to
+    uint64_t objHash = 0;
+    if (sFailureCache.enabled()) {
+        for (const auto& cs : obj.cs) {
+            if (cs.prog_def && cs.prog_def->optional) objHash = objectHash(obj);
+            if (objHash) break;
+        }
+    }
 
-    ret = loadCodeSections(elfPath, cs, string(license.data()), location.prefix);
+    int ret = loadCodeSections(obj.elfPath.c_str(), obj.cs, obj.license, obj.mapIds,
+                               location.prefix, objHash, obj.timings, obj.footprint,
+                               obj.verifierStats);
     if (ret) ALOGE("Failed to load programs, loadCodeSections ret=%d", ret);
 
     return ret;
 }
 
+int loadProg(const char* elfPath, bool* isCritical, const Location& location) {
+    int ret;
+
+    if (!isCritical) return -1;
+    *isCritical = false;
+
+    objectState obj;
+    obj.elfPath = elfPath;
+
+    ret = readObject(obj, location);
+    *isCritical = obj.isCritical;
+    if (ret) return ret;
+
+    ret = createObjectMaps(obj, location);
+    if (!ret) {
+        ret = loadObjectPrograms(obj, location);
+        sFailureCache.save();
+    }
+    clearRegistries();  // the caller may change the pins before loading again
+    clearMigratedMaps();
+    return ret;
+}
+
+/* What an object pinned (or reused), once loaded */
+static vector<string> getObjectPins(const objectState& obj, const char* prefix) {
+    string objName = pathToObjName(obj.elfPath);
+    vector<string> pins;
+
+    for (size_t i = 0; i < obj.mapFds.size(); i++) {
+        if (obj.mapFds[i].ok()) pins.push_back(getMapPinLoc(prefix, objName, obj.md[i],
+                                                            obj.mapNames[i]));
+    }
+    for (const auto& cs : obj.cs) {
+        if (cs.prog_fd.ok()) pins.push_back(getProgPinLoc(prefix, objName, cs.name));
+    }
+    return pins;
+}
+
+/* A node of the load scheduler's dependency graph, one per object */
+struct loadNode {
+    objectState obj;
+    const Location* location = nullptr;
+    int parseRet = 0;
+    bool skip = false;      /* another version of the object applies */
+    vector<int> afterMaps;  /* nodes waiting for our maps to be created */
+    vector<int> afterDone;  /* nodes waiting for us to be fully loaded */
+    int pending = 0;        /* number of our own dependencies still outstanding */
+    int criticalPred = -1;  /* the dependency that released us last */
+    std::chrono::steady_clock::time_point startedAt;
+    std::chrono::steady_clock::time_point finishedAt;
+};
+
+/*
+ * Dependencies of each node on earlier ones: a node declaring a map pin path already declared
+ * by an earlier node (ie. a shared map) creates its maps after that node has, so the first one
+ * in load order still creates and pins it. A node with the same pin name as an earlier one
+ * (foo@1.o and foo@2.o) only starts once that one is completely done, since their programs
+ * share pin paths too. Edges only point forwards, so the graph is acyclic.
+ */
+static void buildLoadGraph(vector<loadNode>& nodes) {
+    std::unordered_map<string, int> lastMapDecl;  // map pin path -> last node declaring it
+    std::unordered_map<string, int> lastObject;   // <prefix><objName> -> last node loading it
+
+    for (int i = 0; i < (int)nodes.size(); i++) {
+        loadNode& node = nodes[i];
+        if (node.parseRet || node.skip) continue;
+
+        const char* prefix = node.location->prefix;
+        string objName = pathToObjName(node.obj.elfPath);
+        std::map<int, bool> deps;  // node -> whether we wait for it to be done (vs. its maps)
+
+        for (int m = 0; m < (int)node.obj.mapNames.size(); m++) {
+            string pinLoc = getMapPinLoc(prefix, objName, node.obj.md[m], node.obj.mapNames[m]);
+            auto it = lastMapDecl.find(pinLoc);
+            if (it != lastMapDecl.end()) deps.emplace(it->second, false);
+            lastMapDecl[pinLoc] = i;
+        }
+
+        auto it = lastObject.find(prefix + objName);
+        if (it != lastObject.end()) deps[it->second] = true;
+        lastObject[prefix + objName] = i;
+
+        for (const auto& [dep, full] : deps) {
+            (full ? nodes[dep].afterDone : nodes[dep].afterMaps).push_back(i);
+        }
+        node.pending = deps.size();
+    }
+}
+
+/* Log the chain of objects which determined the total load time */
+static void logCriticalPath(const vector<loadNode>& nodes,
+                            std::chrono::steady_clock::time_point begin) {
+    using std::chrono::duration_cast;
+    using std::chrono::milliseconds;
+
+    int last = -1;
+    for (int i = 0; i < (int)nodes.size(); i++) {
+        if (last == -1 || nodes[i].finishedAt > nodes[last].finishedAt) last = i;
+    }
+    if (last == -1) return;
+
+    vector<string> path;
+    for (int i = last; i != -1; i = nodes[i].criticalPred) {
+        long ms = duration_cast<milliseconds>(nodes[i].finishedAt - nodes[i].startedAt).count();
+        path.push_back(nodes[i].obj.elfPath + " (" + std::to_string(ms) + "ms)");
+    }
+    std::reverse(path.begin(), path.end());
+
+    long totalMs = duration_cast<milliseconds>(nodes[last].finishedAt - begin).count();
+    ALOGI("critical path %ldms: %s", totalMs, android::base::Join(path, " -> ").c_str());
+}
+
+/*
+ * Of the versions of an object in a location (foo@1.o, foo@2.o, ...) only the one for this
+ * bpfloader is meant to be loaded: pick it from their bpfloader_{min,max}_ver alone, before
+ * anything is parsed. Returns which targets to skip. Should several versions apply, the one
+ * with the highest bpfloader_min_ver wins, should none, all are skipped (even a lone foo@1.o).
+ * Objects which can't be read aren't skipped, loading them reports the error.
+ */
+static vector<bool> selectObjectVersions(const vector<LoadTarget>& targets) {
+    std::map<std::pair<const Location*, string>, vector<int>> versions;
+    vector<bool> skip(targets.size());
+
+    for (int i = 0; i < (int)targets.size(); i++) {
+        versions[{targets[i].location, pathToObjName(targets[i].elfPath)}].push_back(i);
+    }
+
+    for (const auto& [key, objects] : versions) {
+        const string& path = targets[objects[0]].elfPath;
+        bool versioned = path.find('@', path.find_last_of('/') + 1) != string::npos;
+        if (objects.size() < 2 && !versioned) continue;
+
+        int selected = -1;
+        unsigned int selectedMinVer = 0;
+        for (int i : objects) {
+            unsigned int minVer, maxVer;
+            if (readObjectVersions(targets[i].elfPath, minVer, maxVer)) continue;
+
+            skip[i] = true;
+            if (BPFLOADER_VERSION < minVer || BPFLOADER_VERSION >= maxVer) {
+                ALOGI("skipping %s, for bpfloader versions [0x%x, 0x%x)",
+                      targets[i].elfPath.c_str(), minVer, maxVer);
+            } else if (selected == -1 || minVer > selectedMinVer) {
+                if (selected != -1) ALOGI("skipping %s", targets[selected].elfPath.c_str());
+                selected = i;
+                selectedMinVer = minVer;
+            } else {
+                ALOGI("skipping %s", targets[i].elfPath.c_str());
+            }
+        }
+        if (selected != -1) skip[selected] = false;
+    }
+    return skip;
+}
+
+static vector<LoadResult> loadTargets(const vector<LoadTarget>& targets, int numWorkers) {
+    auto begin = std::chrono::steady_clock::now();
+    vector<LoadResult> results(targets.size());
+    vector<loadNode> nodes(targets.size());
+    vector<bool> skip = selectObjectVersions(targets);
+    // numWorkers is what the caller asked for, it isn't cut to the budget
+    int workerThreads = sSpareThreads.take(numWorkers - 1);
+
+    // Parsing has no side effects outside of this process, so it all happens up front.
+    parallelFor(nodes.size(), numWorkers, [&](int i) {
+        nodes[i].obj.elfPath = targets[i].elfPath;
+        nodes[i].location = targets[i].location;
+        nodes[i].skip = skip[i];
+        if (nodes[i].skip) return;
+        nodes[i].parseRet = readObject(nodes[i].obj, *targets[i].location);
+        results[i].isCritical = nodes[i].obj.isCritical;
+    });
+
+    buildLoadGraph(nodes);
+
+    // Locations in the order of their first target. Loading them one after another would stop
+    // at the first location with a failed critical object, so once one fails, the objects of
+    // later locations which haven't started yet aren't loaded either (ret -ECANCELED).
+    vector<int> locationRank(nodes.size());
+    std::unordered_map<const Location*, int> ranks;
+    for (int i = 0; i < (int)nodes.size(); i++) {
+        locationRank[i] = ranks.try_emplace(targets[i].location, ranks.size()).first->second;
+    }
+    int failedRank = INT_MAX;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    vector<int> ready;
+    int remaining = nodes.size();
+
+    for (int i = 0; i < (int)nodes.size(); i++) {
+        if (!nodes[i].pending) ready.push_back(i);
+    }
+
+    auto release = [&](const vector<int>& waiters, int from) {
+        for (int w : waiters) {
+            if (--nodes[w].pending) continue;
+            nodes[w].criticalPred = from;
+            ready.push_back(w);
+        }
+        changed.notify_all();
+    };
+
+    // Critical objects first, otherwise in load order.
+    auto takeNext = [&]() {
+        auto next = std::min_element(ready.begin(), ready.end(), [&](int a, int b) {
+            if (nodes[a].obj.isCritical != nodes[b].obj.isCritical) return nodes[a].obj.isCritical;
+            return a < b;
+        });
+        int i = *next;
+        ready.erase(next);
+        return i;
+    };
+
+    parallelFor(numWorkers, numWorkers, [&](int) {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            changed.wait(lock, [&] { return !ready.empty() || !remaining; });
+            if (ready.empty()) return;
+
+            int i = takeNext();
+            loadNode& node = nodes[i];
+            bool cancelled = locationRank[i] > failedRank;
+            lock.unlock();
+
+            node.startedAt = std::chrono::steady_clock::now();
+            int ret = cancelled ? -ECANCELED : node.parseRet;
+            if (cancelled) {
+                ALOGE("not loading %s after a critical failure", node.obj.elfPath.c_str());
+            }
+            if (!ret && !node.skip) ret = createObjectMaps(node.obj, *node.location);
+
+            lock.lock();
+            release(node.afterMaps, i);
+            lock.unlock();
+
+            if (!ret && !node.skip) ret = loadObjectPrograms(node.obj, *node.location);
+            if (!ret && !node.skip) {
+                results[i].pinPaths = getObjectPins(node.obj, node.location->prefix);
+            }
+            node.finishedAt = std::chrono::steady_clock::now();
+
+            lock.lock();
+            if (ret && !cancelled && node.obj.isCritical) {
+                failedRank = std::min(failedRank, locationRank[i]);
+            }
+            results[i].ret = ret;
+            results[i].timings = std::move(node.obj.timings);
+            results[i].footprint = std::move(node.obj.footprint);
+            results[i].verifierStats = std::move(node.obj.verifierStats);
+            release(node.afterDone, i);
+            if (!--remaining) changed.notify_all();
+        }
+    });
+
+    sSpareThreads.give(workerThreads);
+    logCriticalPath(nodes, begin);
+    sFailureCache.save();
+    clearRegistries();
+    return results;
+}
+
+vector<LoadResult> loadProgs(const vector<LoadTarget>& targets, int numWorkers) {
+    vector<LoadResult> results = loadTargets(targets, numWorkers);
+    clearMigratedMaps();
+    return results;
+}
+
+vector<LoadResult> loadProgs(const vector<string>& elfPaths, const Location& location,
+                             int numWorkers) {
+    vector<LoadTarget> targets;
+    for (const auto& elfPath : elfPaths) targets.push_back({elfPath, &location});
+    return loadProgs(targets, numWorkers);
+}
+
+/*
+ * An object as recorded in the manifest of loadProgsIncremental(), one per line:
+ *   <hash> <critical> <object path> <pin path>...
+ * with hash the hashElfObject() of the object in hex, and critical 0 or 1.
+ */
+struct manifestEntry {
+    uint64_t hash;
+    bool isCritical;
+    vector<string> pinPaths;
+};
+
+static std::unordered_map<string, manifestEntry> readManifest(const string& path) {
+    std::unordered_map<string, manifestEntry> manifest;
+    string contents;
+
+    if (!android::base::ReadFileToString(path, &contents)) return manifest;
+    for (const auto& line : android::base::Split(contents, "\n")) {
+        vector<string> fields = android::base::Split(line, " ");
+        if (fields.size() < 3) continue;
+        manifestEntry& entry = manifest[fields[2]];
+        entry.hash = strtoull(fields[0].c_str(), nullptr, 16);
+        entry.isCritical = fields[1] == "1";
+        entry.pinPaths.assign(fields.begin() + 3, fields.end());
+    }
+    return manifest;
+}
+
+static void writeManifest(const string& path,
+                          const std::map<string, manifestEntry>& manifest) {
+    string out;
+    for (const auto& [elfPath, entry] : manifest) {
+        out += android::base::StringPrintf("%016" PRIx64 " %d %s", entry.hash, entry.isCritical,
+                                           elfPath.c_str());
+        for (const auto& pinPath : entry.pinPaths) out += " " + pinPath;
+        out += "\n";
+    }
+
+    string tmpPath = path + ".tmp";
+    if (!android::base::WriteStringToFile(out, tmpPath) || rename(tmpPath.c_str(), path.c_str())) {
+        ALOGW("Failed to write %s: %s", path.c_str(), strerror(errno));
+        unlink(tmpPath.c_str());
+    }
+}
+
+/* The hashElfObject() of the file at path, 0 if it can't be read */
+static uint64_t hashObjectFile(const string& path) {
+    unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st;
+
+    if (!fd.ok() || fstat(fd, &st) || st.st_size <= 0) return 0;
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return 0;
+    uint64_t hash = hashElfObject(static_cast<const char*>(data), st.st_size);
+    munmap(data, st.st_size);
+    return hash;
+}
+
+vector<LoadResult> loadProgsIncremental(const vector<LoadTarget>& targets, int numWorkers,
+                                        const string& manifestPath) {
+    std::unordered_map<string, manifestEntry> previous = readManifest(manifestPath);
+    std::map<string, manifestEntry> current;
+    vector<LoadResult> results(targets.size());
+    vector<uint64_t> hashes(targets.size());
+    vector<int> toLoad;
+    vector<int> unchangedIdx;
+    vector<bool> skip = selectObjectVersions(targets);
+
+    parallelFor(targets.size(), numWorkers, [&](int i) {
+        if (!skip[i]) hashes[i] = hashObjectFile(targets[i].elfPath);
+    });
+
+    for (int i = 0; i < (int)targets.size(); i++) {
+        if (skip[i]) continue;
+
+        auto it = previous.find(targets[i].elfPath);
+        bool unchanged = hashes[i] && it != previous.end() && it->second.hash == hashes[i];
+        for (size_t p = 0; unchanged && p < it->second.pinPaths.size(); p++) {
+            unchanged = !getBpfBackend().access(it->second.pinPaths[p].c_str(), F_OK);
+        }
+        if (unchanged) {
+            ALOGV("Unchanged since the last load: %s", targets[i].elfPath.c_str());
+            results[i].isCritical = it->second.isCritical;
+            results[i].pinPaths = it->second.pinPaths;
+            current[targets[i].elfPath] = it->second;
+            unchangedIdx.push_back(i);
+            continue;
+        }
+        toLoad.push_back(i);
+    }
+    ALOGI("Incremental load of %zu out of %zu objects", toLoad.size(), targets.size());
+
+    auto load = [&](const vector<int>& idxs) {
+        vector<LoadTarget> batch;
+        for (int i : idxs) batch.push_back(targets[i]);
+        vector<LoadResult> loaded = loadTargets(batch, numWorkers);
+        for (size_t n = 0; n < idxs.size(); n++) {
+            int i = idxs[n];
+            results[i] = std::move(loaded[n]);
+            if (!results[i].ret) {
+                current[targets[i].elfPath] = {hashes[i], results[i].isCritical,
+                                               results[i].pinPaths};
+                continue;
+            }
+            // Whatever the last successful load of it left pinned is still in use
+            auto it = previous.find(targets[i].elfPath);
+            if (it != previous.end()) current[targets[i].elfPath] = it->second;
+        }
+    };
+    load(toLoad);
+
+    // The programs of unchanged objects sharing a map that was migrated still use the old map:
+    // load those objects again as well, which replaces their programs
+    std::set<string> migrated = migratedMaps();
+    toLoad.clear();
+    for (int i : unchangedIdx) {
+        for (const auto& pinPath : current[targets[i].elfPath].pinPaths) {
+            if (!migrated.count(pinPath)) continue;
+            toLoad.push_back(i);
+            break;
+        }
+    }
+    if (!toLoad.empty()) {
+        ALOGI("Reloading %zu unchanged objects using migrated maps", toLoad.size());
+        load(toLoad);
+    }
+    clearMigratedMaps();
+
+    // Unpin what nothing loaded now has pinned, ie. the objects which were removed
+    std::unordered_map<string, bool> inUse;
+    for (const auto& [elfPath, entry] : current) {
+        for (const auto& pinPath : entry.pinPaths) inUse[pinPath] = true;
+    }
+    for (const auto& [elfPath, entry] : previous) {
+        for (const auto& pinPath : entry.pinPaths) {
+            if (inUse.count(pinPath)) continue;
+            ALOGI("Unpinning %s of %s", pinPath.c_str(), elfPath.c_str());
+            if (getBpfBackend().unlink(pinPath.c_str()) && errno != ENOENT) {
+                ALOGW("Failed to unpin %s: %s", pinPath.c_str(), strerror(errno));
+            }
+        }
+    }
+
+    writeManifest(manifestPath, current);
+    return results;
+}
+
 }  // namespace bpf
 }  // namespace android
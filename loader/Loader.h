@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ * Android BPF library - loader internals
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/bpf.h>
+#include <linux/elf.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+#include "bpf/bpf_map_def.h"
+#include "bpf_map_scaling.h"
+
+// Internal interfaces of Loader.cpp, exposed for tests and benchmarks only.
+
+// The version checked against the bpfloader_{min,max}_ver of objects, maps and programs
+#define BPFLOADER_VERSION 0x29u
+
+// What bpf_helpers.h defaults them to, for objects without bpfloader_{min,max}_ver sections
+#ifndef DEFAULT_BPFLOADER_MIN_VER
+#define DEFAULT_BPFLOADER_MIN_VER 0u
+#endif
+#ifndef DEFAULT_BPFLOADER_MAX_VER
+#define DEFAULT_BPFLOADER_MAX_VER 0x10000u
+#endif
+
+namespace android {
+namespace bpf {
+
+/*
+ * A view of a section's contents inside the ELF object. The object is mapped privately and
+ * writable, so patching a view (ie. relocating code) only copies the touched pages.
+ */
+class sectionView {
+  public:
+    sectionView() = default;
+    sectionView(char* data, size_t size) : mData(data), mSize(size) {}
+
+    char* data() const { return mData; }
+    size_t size() const { return mSize; }
+    char& operator[](size_t i) const { return mData[i]; }
+
+  private:
+    char* mData = nullptr;
+    size_t mSize = 0;
+};
+
+/* A map relocation resolved to the map it refers to, by index into the object's maps */
+typedef struct {
+    uint64_t offset;  /* byte offset of the ld_imm64 instruction within the code */
+    uint32_t mapIdx;
+} mapRelo;
+
+typedef struct {
+    enum bpf_prog_type type;
+    enum bpf_attach_type expected_attach_type;
+    std::string name;
+    sectionView data;
+    sectionView rel_data;
+    std::vector<mapRelo> relos; /* rel_data resolved by resolveMapRelos() */
+    std::optional<struct bpf_prog_def> prog_def;
+
+    android::base::unique_fd prog_fd; /* fd after loading */
+} codeSection;
+
+/*
+ * An ELF object parsed once. The file is mmap'ed copy-on-write and the header, section header
+ * table, section header string table, symbol string table and symbol table are indexed up front,
+ * together with lookup tables from section name to section index and from section index to the
+ * symbols defined in it. Section contents are handed out as views into the mapping.
+ */
+struct ElfObject {
+    ElfObject() = default;
+    ElfObject(const ElfObject&) = delete;
+    ElfObject& operator=(const ElfObject&) = delete;
+    ~ElfObject() {
+        if (mapped) munmap(base, size);
+    }
+
+    char* base = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    std::vector<char> buffer;  // backing store when the object was read from a stream instead
+
+    Elf64_Ehdr header;
+    const Elf64_Shdr* shTable = nullptr;
+    int shnum = 0;
+    sectionView shStrtab;
+    sectionView strtab;
+    const Elf64_Sym* symtab = nullptr;  // indexed by ELF symbol index
+    int symnum = 0;
+    std::unordered_map<std::string, int> sectionIdx;
+    std::vector<std::vector<int>> sectionSyms;  // symtab indices per section, sorted by st_value
+};
+
+/*
+ * Everything the load stages need from an object, read either from its ELF file or from the
+ * bpfpack generated from it at build time. Code sections point into the file's mapping.
+ */
+struct objectContents {
+    bool isCritical = false;
+    std::string critical;
+    std::string license;
+    std::vector<struct bpf_map_def> md;
+    std::vector<std::string> mapNames;
+    std::vector<struct bpf_map_scaling> scaling;  // of some maps, by name
+    std::vector<codeSection> cs;
+};
+
+/* What map and program definitions are checked against */
+struct loadEnv {
+    unsigned kvers;         /* of the running kernel */
+    std::string buildType;  /* ro.build.type, ie. "user" */
+};
+
+/* Why a map or program definition doesn't apply in env, or nullptr if it does */
+template <typename T>
+const char* excludedBy(const T& def, const loadEnv& env) {
+    if (env.kvers < def.min_kver || env.kvers >= def.max_kver) return "kernel version";
+    if (BPFLOADER_VERSION < def.bpfloader_min_ver || BPFLOADER_VERSION >= def.bpfloader_max_ver)
+        return "bpfloader version";
+    if ((def.ignore_on_eng && env.buildType == "eng") ||
+        (def.ignore_on_user && env.buildType == "user") ||
+        (def.ignore_on_userdebug && env.buildType == "userdebug"))
+        return "build type";
+    return nullptr;
+}
+
+/*
+ * Programs may come in variants, code sections named <program>$<suffix>, which share a pin: they
+ * are tried in section order until one loads, so a failed optional variant falls back to the
+ * next. Returns the indices of the code sections to keep, in order: all the variants of a
+ * program up to and including the first non-optional one, the ones after it are never tried.
+ */
+std::vector<size_t> selectProgVariants(const std::vector<codeSection>& cs);
+
+int mapElfObject(const char* elfPath, ElfObject& elf);
+int readSectionByName(const char* name, const ElfObject& elf, sectionView& data);
+int getSectionSymNames(const ElfObject& elf, const std::string& sectionName,
+                       std::vector<std::string>& names,
+                       std::optional<unsigned> symbolType = std::nullopt);
+int readMapDefs(const ElfObject& elf, std::vector<struct bpf_map_def>& md,
+                std::vector<std::string>& mapNames);
+int readMapScaling(const ElfObject& elf, std::vector<struct bpf_map_scaling>& scaling);
+int initCodeSection(const std::string& sectionName, codeSection& cs,
+                    const bpf_prog_type* allowed, size_t numAllowed);
+int readCodeSections(const ElfObject& elf, std::vector<codeSection>& cs,
+                     const bpf_prog_type* allowed, size_t numAllowed,
+                     const loadEnv* env = nullptr);
+void resolveMapRelos(const ElfObject& elf, std::vector<codeSection>& cs);
+
+// The tag the kernel reports for these instructions in bpf_prog_info, see calcProgTag()
+void calcProgTag(const struct bpf_insn* insns, size_t count, bool sha256,
+                 uint8_t tag[BPF_TAG_SIZE]);
+
+void applyMapRelo(std::vector<android::base::unique_fd>& mapFds, std::vector<codeSection>& cs);
+
+}  // namespace bpf
+}  // namespace android
@@ -0,0 +1,254 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/bpf.h>
+#include <linux/elf.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+
+#include "bpf/bpf_map_def.h"
+#include "bpf_map_scaling.h"
+
+// Test and benchmark helper, generates BPF ELF objects in the layout the loader expects.
+
+// linux/elf.h has no EM_BPF relocation types
+#define R_BPF_64_64 1
+
+namespace android {
+namespace bpf {
+
+/*
+ * Writes a minimal BPF ELF object with 'numMaps' maps and 'numProgs' tracepoint programs,
+ * each of which carries 'relosPerProg' map relocations spread round robin over the maps and
+ * 'labelsPerProg' local symbols, like the branch target labels clang emits.
+ * The programs pass the verifier, they only load the map pointers and return their index, so
+ * that no two of them are identical. They are marked optional if 'optionalProgs' is set. The
+ * maps are hashes of 'mapMaxEntries' entries with 4 byte keys and values.
+ */
+class SyntheticElf {
+  public:
+    SyntheticElf(int numMaps, int numProgs, int relosPerProg, int labelsPerProg = 0,
+                 bool optionalProgs = false, unsigned mapMaxEntries = 16) {
+        addString("");  // strtab offset 0 is the empty string
+        addSection("", SHT_NULL, {});
+        mStrtabIdx = addSection(".strtab", SHT_STRTAB, {});
+        addSection("license", SHT_PROGBITS, toBytes("Apache 2.0", sizeof("Apache 2.0")));
+
+        std::vector<char> maps(numMaps * sizeof(bpf_map_def));
+        for (int i = 0; i < numMaps; i++) {
+            bpf_map_def md = {};
+            md.type = BPF_MAP_TYPE_HASH;
+            md.key_size = 4;
+            md.value_size = 4;
+            md.max_entries = mapMaxEntries;
+            md.mode = 0600;
+            md.max_kver = 0xFFFFFFFF;
+            md.bpfloader_max_ver = 0x10000;  // bpf_helpers.h's DEFAULT_BPFLOADER_MAX_VER
+            memcpy(maps.data() + i * sizeof(md), &md, sizeof(md));
+        }
+        int mapsIdx = mMapsIdx = addSection("maps", SHT_PROGBITS, maps);
+
+        std::vector<char> progs(numProgs * sizeof(bpf_prog_def));
+        for (int i = 0; i < numProgs; i++) {
+            bpf_prog_def pd = {};
+            pd.max_kver = 0xFFFFFFFF;
+            pd.bpfloader_max_ver = 0x10000;
+            pd.optional = optionalProgs;
+            memcpy(progs.data() + i * sizeof(pd), &pd, sizeof(pd));
+        }
+        int progsIdx = mProgsIdx = addSection("progs", SHT_PROGBITS, progs);
+
+        std::vector<int> mapSyms;
+        for (int i = 0; i < numMaps; i++) {
+            mapSyms.push_back(addSymbol("map_" + std::to_string(i), STT_OBJECT, mapsIdx,
+                                        i * sizeof(bpf_map_def)));
+        }
+        for (int i = 0; i < numProgs; i++) {
+            addSymbol("prog_" + std::to_string(i) + "_def", STT_OBJECT, progsIdx,
+                      i * sizeof(bpf_prog_def));
+        }
+
+        std::vector<int>& codeIdxs = mCodeIdxs;
+        for (int i = 0; i < numProgs; i++) {
+            std::vector<bpf_insn> insns;
+            std::vector<Elf64_Rel> rels;
+            for (int r = 0; r < relosPerProg; r++) {
+                Elf64_Rel rel = {
+                        .r_offset = insns.size() * sizeof(bpf_insn),
+                        .r_info = (Elf64_Xword)mapSyms[r % numMaps] << 32 | R_BPF_64_64,
+                };
+                rels.push_back(rel);
+                insns.push_back({.code = BPF_LD | BPF_IMM | BPF_DW, .dst_reg = 1});
+                insns.push_back({});
+            }
+            insns.push_back({.code = BPF_ALU64 | BPF_MOV | BPF_K, .imm = i});  // r0 = i
+            insns.push_back({.code = BPF_JMP | BPF_EXIT});
+
+            std::string name = "tracepoint/prog_" + std::to_string(i);
+            mCodeSections.push_back(name);
+            int codeIdx = addSection(name, SHT_PROGBITS,
+                                     toBytes(insns.data(), insns.size() * sizeof(bpf_insn)));
+            addSection(".rel" + name, SHT_REL,
+                       toBytes(rels.data(), rels.size() * sizeof(Elf64_Rel)));
+            codeIdxs.push_back(codeIdx);
+
+            for (int l = 0; l < labelsPerProg; l++) {
+                Elf64_Addr off = (l * insns.size() / labelsPerProg) * sizeof(bpf_insn);
+                addSymbol("LBB" + std::to_string(i) + "_" + std::to_string(l), STT_NOTYPE,
+                          codeIdx, off, STB_LOCAL);
+            }
+        }
+        for (int i = 0; i < numProgs; i++) {
+            addSymbol("prog_" + std::to_string(i), STT_FUNC, codeIdxs[i], 0);
+        }
+
+        int symtabIdx = addSection(".symtab", SHT_SYMTAB,
+                                   toBytes(mSyms.data(), mSyms.size() * sizeof(Elf64_Sym)));
+        mShdrs[symtabIdx].sh_link = mStrtabIdx;
+        mShdrs[symtabIdx].sh_entsize = sizeof(Elf64_Sym);
+        for (auto& sh : mShdrs) {
+            if (sh.sh_type == SHT_REL) sh.sh_link = symtabIdx;
+        }
+    }
+
+    const std::vector<std::string>& codeSections() const { return mCodeSections; }
+
+    // Makes map 'map' shared, ie. pinned without the object name. Must come before write().
+    void setMapShared(int map) {
+        reinterpret_cast<bpf_map_def*>(mSections[mMapsIdx].data())[map].shared = true;
+    }
+
+    // Makes program 'prog' a variant <name>$<suffix> of a program, for kernels [minKver, maxKver).
+    // Must come before write().
+    void setProgVariant(int prog, const std::string& name, const std::string& suffix,
+                        unsigned minKver, unsigned maxKver) {
+        bpf_prog_def* pd = reinterpret_cast<bpf_prog_def*>(mSections[mProgsIdx].data()) + prog;
+        pd->min_kver = minKver;
+        pd->max_kver = maxKver;
+        mCodeSections[prog] = "tracepoint/" + name + "$" + suffix;
+        mShdrs[mCodeIdxs[prog]].sh_name = addString(mCodeSections[prog]);
+        mShdrs[mCodeIdxs[prog] + 1].sh_name = addString(".rel" + mCodeSections[prog]);
+    }
+
+    // Adds a section holding a single LE32 value, ie. bpfloader_min_ver. Must come before write().
+    void addUintSection(const std::string& name, unsigned value) {
+        addSection(name, SHT_PROGBITS, toBytes(&value, sizeof(value)));
+    }
+
+    // Adds a map_scaling section, see bpf_map_scaling.h. Must come before write().
+    void addMapScaling(const std::vector<struct bpf_map_scaling>& scaling) {
+        addSection("map_scaling", SHT_PROGBITS,
+                   toBytes(scaling.data(), scaling.size() * sizeof(scaling[0])));
+    }
+
+    // Writes the object to a temporary file, returns its path.
+    const char* write() {
+        mSections[mStrtabIdx] = mStrtab;
+        layout(mStrtabIdx);
+        if (!android::base::WriteFully(mFile.fd, mImage.data(), mImage.size())) abort();
+        return mFile.path;
+    }
+
+  private:
+    template <typename T>
+    static std::vector<char> toBytes(const T* p, size_t len) {
+        const char* c = reinterpret_cast<const char*>(p);
+        return std::vector<char>(c, c + len);
+    }
+
+    int addString(const std::string& s) {
+        int off = mStrtab.size();
+        mStrtab.insert(mStrtab.end(), s.begin(), s.end());
+        mStrtab.push_back('\0');
+        return off;
+    }
+
+    int addSection(const std::string& name, Elf64_Word type, std::vector<char> data) {
+        Elf64_Shdr sh = {};
+        sh.sh_name = name.empty() ? 0 : addString(name);
+        sh.sh_type = type;
+        sh.sh_addralign = 8;
+        mShdrs.push_back(sh);
+        mSections.push_back(std::move(data));
+        return mShdrs.size() - 1;
+    }
+
+    int addSymbol(const std::string& name, int type, int shndx, Elf64_Addr value,
+                  int bind = STB_GLOBAL) {
+        if (mSyms.empty()) mSyms.push_back({});  // symbol 0 is reserved
+        Elf64_Sym sym = {};
+        sym.st_name = addString(name);
+        sym.st_info = bind << 4 | type;
+        sym.st_shndx = shndx;
+        sym.st_value = value;
+        mSyms.push_back(sym);
+        return mSyms.size() - 1;
+    }
+
+    void layout(int shstrndx) {
+        size_t off = sizeof(Elf64_Ehdr);
+        for (size_t i = 0; i < mSections.size(); i++) {
+            off = (off + 7) & ~7;
+            mShdrs[i].sh_offset = off;
+            mShdrs[i].sh_size = mSections[i].size();
+            off += mSections[i].size();
+        }
+        off = (off + 7) & ~7;
+
+        Elf64_Ehdr eh = {};
+        memcpy(eh.e_ident, ELFMAG, SELFMAG);
+        eh.e_ident[EI_CLASS] = ELFCLASS64;
+        eh.e_ident[EI_DATA] = ELFDATA2LSB;
+        eh.e_ident[EI_VERSION] = EV_CURRENT;
+        eh.e_type = ET_REL;
+        eh.e_machine = EM_BPF;
+        eh.e_version = EV_CURRENT;
+        eh.e_shoff = off;
+        eh.e_ehsize = sizeof(Elf64_Ehdr);
+        eh.e_shentsize = sizeof(Elf64_Shdr);
+        eh.e_shnum = mShdrs.size();
+        eh.e_shstrndx = shstrndx;
+
+        mImage.assign(off + mShdrs.size() * sizeof(Elf64_Shdr), 0);
+        memcpy(mImage.data(), &eh, sizeof(eh));
+        for (size_t i = 0; i < mSections.size(); i++) {
+            memcpy(mImage.data() + mShdrs[i].sh_offset, mSections[i].data(), mSections[i].size());
+        }
+        memcpy(mImage.data() + off, mShdrs.data(), mShdrs.size() * sizeof(Elf64_Shdr));
+    }
+
+    int mStrtabIdx;
+    int mMapsIdx;
+    int mProgsIdx;
+    std::vector<int> mCodeIdxs;
+    std::vector<char> mStrtab;
+    std::vector<Elf64_Shdr> mShdrs;
+    std::vector<std::vector<char>> mSections;
+    std::vector<Elf64_Sym> mSyms;
+    std::vector<char> mImage;
+    std::vector<std::string> mCodeSections;
+    TemporaryFile mFile;
+};
+
+}  // namespace bpf
+}  // namespace android
@@ -19,7 +19,12 @@
 
 #include <linux/bpf.h>
 
+#include <stdint.h>
+
 #include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace android {
 namespace bpf {
@@ -34,6 +39,91 @@ struct Location {
 // BPF loader implementation. Loads an eBPF ELF object
 int loadProg(const char* elfPath, bool* isCritical, const Location &location = {});
 
+// Where loading an object spent its time, all in microseconds of CLOCK_MONOTONIC time
+struct LoadTimings {
+    int64_t parseUs = 0;     // mapping and indexing the object, reading its code sections
+    int64_t mapsUs = 0;      // creating or reusing maps, excluding pinning
+    int64_t reloUs = 0;      // applying map relocations
+    int64_t progLoadUs = 0;  // sum over all BPF_PROG_LOAD calls, which may run concurrently
+    int64_t pinUs = 0;       // pinning, chmod and chown of maps and programs
+    int64_t totalUs = 0;     // wall time of all of the above, excluding time spent queued
+    std::vector<std::pair<std::string, int64_t>> progLoads;  // BPF_PROG_LOAD time per program
+};
+
+// Kernel memory taken by the maps and programs a load created, in bytes. Reused maps and
+// programs are not counted. Map sizes are estimated from their definitions (the kernel doesn't
+// report them), program sizes are the kernel's xlated and JITed lengths.
+struct LoadFootprint {
+    int64_t mapBytes = 0;
+    int64_t progXlatedBytes = 0;
+    int64_t progJitedBytes = 0;
+    std::vector<std::pair<std::string, int64_t>> maps;   // estimate per created map
+    std::vector<std::pair<std::string, int64_t>> progs;  // JITed (or else xlated) per program
+};
+
+// What the verifier reported about a program it accepted, on 5.2+ kernels. Its time and
+// processed instructions (which the complexity limit applies to) are the ones to watch.
+struct VerifierStats {
+    std::string prog;
+    int64_t verificationUs = 0;  // as measured by the kernel
+    int64_t insnsProcessed = 0;
+    int64_t totalStates = 0;
+    int64_t peakStates = 0;
+};
+
+struct LoadResult {
+    int ret = 0;
+    bool isCritical = false;
+    LoadTimings timings;
+    LoadFootprint footprint;
+    std::vector<VerifierStats> verifierStats;  // per program loaded
+    std::vector<std::string> pinPaths;  // maps and programs pinned or reused, if ret is 0
+};
+
+struct LoadTarget {
+    std::string elfPath;
+    const Location* location = nullptr;
+};
+
+// Loads eBPF ELF objects, possibly from several locations, on up to numWorkers threads. What
+// is left of one thread per CPU (up to 8) then verifies the programs of an object concurrently.
+// Objects are scheduled as a dependency graph: only objects declaring the same map pin
+// path (ie. a shared map), or sharing an object name, are ordered against each other, in
+// targets order. Everything else runs concurrently, critical objects first. Result i is
+// what loadProg() would have returned for targets[i] when loading all targets in order.
+// Of several versions of an object in a location (foo@1.o, foo@2.o) only the one for this
+// bpfloader's version is loaded, the others are skipped (ret 0, nothing pinned). Once a
+// critical object fails, the objects of later locations (in targets order) which haven't
+// started loading yet aren't loaded (ret -ECANCELED).
+std::vector<LoadResult> loadProgs(const std::vector<LoadTarget>& targets, int numWorkers);
+
+// As above, for objects from a single location.
+std::vector<LoadResult> loadProgs(const std::vector<std::string>& elfPaths,
+                                  const Location& location, int numWorkers);
+
+// As loadProgs(), but only for the objects which changed since the last run: the manifest at
+// manifestPath records each object's hash and pins. Objects recorded with the same hash whose
+// pins all still exist are skipped (results have no timings), unless they share a map that
+// loading the others migrated (see setMapMigration). The pins of objects no longer loaded are
+// removed, and the manifest is rewritten. Without a manifest, everything is loaded.
+std::vector<LoadResult> loadProgsIncremental(const std::vector<LoadTarget>& targets,
+                                             int numWorkers, const std::string& manifestPath);
+
+// Whether to migrate pinned maps which don't match their definition (ie. when an update grows
+// max_entries) instead of failing the object with -ENOTUNIQ: a new map is created with the
+// entries of the old one, and pinned in its place. Off by default.
+void setMapMigration(bool enable);
+
+// Remember optional programs which fail verification in the file at path, and skip them in
+// later runs for as long as neither their object nor the kernel build changes. The directory
+// must exist. Empty (the default) disables this.
+void setLoadFailureCache(const std::string& path);
+
+// Fail objects with -ENOMEM once the maps and programs created from this call on would take more
+// than bytes of kernel memory, counted as in LoadFootprint. Whatever was created before the
+// budget ran out stays. 0 (the default) for no limit.
+void setMemoryBudget(int64_t bytes);
+
 // Exposed for testing
 unsigned int readSectionUint(const char* name, std::ifstream& elfFile, unsigned int defVal);
 
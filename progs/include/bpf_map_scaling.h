@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2024 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+/*
+ * Machine scaled map sizes. The max_entries a map is defined with is the size it gets on the
+ * smallest machine, BPF_MAP_SCALING() lets bpfloader grow it on bigger ones:
+ *
+ *   max_entries = max(max_entries, per_cpu * possible cpus, per_gib * GiB of RAM)
+ *
+ * capped at max (unless 0). ie.
+ *
+ *   DEFINE_BPF_MAP(uid_stats_map, HASH, uint32_t, stats_t, 1024)
+ *   BPF_MAP_SCALING(uid_stats_map, 0, 512, 8192);
+ *
+ * Independently of this, devices can set the max_entries of any map with the property
+ * ro.bpfloader.max_entries.<pin name>, where the pin name is the map's path under /sys/fs/bpf/
+ * with '/' replaced by '.' (ie. ro.bpfloader.max_entries.map_foo_uid_stats_map). Either way, a
+ * resized ring buffer is rounded up to a power of two multiple of the page size.
+ */
+
+#define BPF_MAP_SCALING_NAME_LEN 64
+
+struct bpf_map_scaling {
+    char map_name[BPF_MAP_SCALING_NAME_LEN];  // NUL terminated
+    unsigned int per_cpu;
+    unsigned int per_gib;
+    unsigned int max;
+};
+
+#define BPF_MAP_SCALING(the_map, perCpu, perGib, maxEntries)                      \
+    const struct bpf_map_scaling __attribute__((section("map_scaling"), used))  \
+            the_map##_scaling = {#the_map, (perCpu), (perGib), (maxEntries)}